@@ -0,0 +1,199 @@
+import socket
+import struct
+import subprocess
+import threading
+import time
+
+# Each scenario gets its own stub resolver, so queries left over from the previous one can't slow it down
+STUB_ADDRESS = "127.0.0.1"
+FIRST_STUB_PORT = 5360
+
+TYPE_A = 1
+
+RCODE_NOERROR = 0
+RCODE_SERVFAIL = 2
+RCODE_REFUSED = 5
+
+
+def encode_name(name):
+    encoded = b""
+    for label in name.split("."):
+        if label:
+            encoded += bytes([len(label)]) + label.encode()
+    return encoded + b"\0"
+
+
+def question_end(message):
+    offset = 12
+    while message[offset] != 0:
+        if message[offset] & 0xC0 == 0xC0:
+            return offset + 2 + 4
+        offset += 1 + message[offset]
+    return offset + 1 + 4
+
+
+def build_response(query, address):
+    end = question_end(query)
+    header = struct.pack(">HHHHHH", struct.unpack(">H", query[:2])[0], 0x8180, 1, 1, 0, 0)
+    answer = b"\xc0\x0c" + struct.pack(">HHIH", TYPE_A, 1, 300, 4) + socket.inet_aton(address)
+    return header + query[12:end] + answer
+
+
+def slow_resolver(port, delay):
+    # answers one query after another, like a resolver that can't keep up
+    server = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    server.bind((STUB_ADDRESS, port))
+    while True:
+        query, client = server.recvfrom(512)
+        time.sleep(delay)
+        server.sendto(build_response(query, "1.2.3.4"), client)
+
+
+def spoofed_resolver(port, delay):
+    # every real response is preceded by forged ones carrying the right ID
+    server = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    server.bind((STUB_ADDRESS, port))
+    spoofer = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    while True:
+        query, client = server.recvfrom(512)
+        # from another port
+        spoofer.sendto(build_response(query, "6.6.6.6"), client)
+        # from the resolver, but to another question
+        other_question = query[:12] + encode_name("other.example.com") + struct.pack(">HH", TYPE_A, 1)
+        server.sendto(build_response(other_question, "6.6.6.6"), client)
+        time.sleep(delay)
+        server.sendto(build_response(query, "1.2.3.4"), client)
+
+
+def build_query(name, id):
+    return struct.pack(">HHHHHH", id, 0x0100, 1, 0, 0, 0) + encode_name(name) + struct.pack(">HH", TYPE_A, 1)
+
+
+def send_queries(names, wait):
+    """Sends all queries at once and returns the first response to each of them in the order they arrived"""
+    client = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    for id, name in enumerate(names):
+        client.sendto(build_query(name, id), ("127.0.0.1", 2053))
+
+    # the server follows every forwarded response with one of its own, only the first one counts
+    responses = {}
+    order = []
+    client.settimeout(wait)
+    try:
+        while True:
+            response = client.recv(512)
+            id, flags = struct.unpack(">HH", response[:4])
+            if id not in responses:
+                responses[id] = (flags & 0xF, socket.inet_aton("1.2.3.4") in response)
+                order.append(id)
+    except socket.timeout:
+        pass
+    return responses, order
+
+
+failures = []
+
+
+def check(description, actual, expected):
+    if actual != expected:
+        failures.append(f"{description}: expected {expected}, got {actual}")
+
+
+scenario_count = 0
+
+
+def run_scenario(delay, arguments, resolver=slow_resolver):
+    global scenario_count
+    port = FIRST_STUB_PORT + scenario_count
+    scenario_count += 1
+
+    threading.Thread(target=resolver, args=(port, delay), daemon=True).start()
+    server = subprocess.Popen(["build/server", "--resolver", "%s:%d" % (STUB_ADDRESS, port)] + arguments, stdout=subprocess.DEVNULL)
+    time.sleep(0.5)
+    return server
+
+
+def stop(server):
+    server.kill()
+    server.wait()
+
+
+names = ["q%d.example.com" % i for i in range(6)]
+
+# queries that run out of time while the resolver is busy with the first one are shed
+for policy, rcode in [("servfail", RCODE_SERVFAIL), ("refused", RCODE_REFUSED)]:
+    server = run_scenario(0.3, ["--deadline-ms", "500", "--shed-policy", policy])
+    try:
+        responses, order = send_queries(names, 2)
+        check("%s: first query" % policy, responses.get(0), (RCODE_NOERROR, True))
+        for id in range(1, len(names)):
+            check("%s: query %d past its deadline" % (policy, id), responses.get(id), (rcode, False))
+    finally:
+        stop(server)
+
+server = run_scenario(0.3, ["--deadline-ms", "500", "--shed-policy", "drop"])
+try:
+    responses, order = send_queries(names, 2)
+    check("drop: first query", responses.get(0), (RCODE_NOERROR, True))
+    check("drop: queries answered", sorted(responses), [0])
+finally:
+    stop(server)
+
+# with room for only two waiting queries, most of a burst is shed right away
+server = run_scenario(0.2, ["--deadline-ms", "5000", "--queue-depth", "2"])
+try:
+    burst = ["burst%d.example.com" % i for i in range(10)]
+    responses, order = send_queries(burst, 3)
+    check("queue full: every query answered", len(responses), len(burst))
+    shed = [id for id, response in responses.items() if response == (RCODE_SERVFAIL, False)]
+    answered = [id for id, response in responses.items() if response == (RCODE_NOERROR, True)]
+    check("queue full: queries shed", len(shed) >= 4, True)
+    check("queue full: queries answered", len(answered) >= 1, True)
+    check("queue full: queries shed or answered", len(shed) + len(answered), len(burst))
+finally:
+    stop(server)
+
+# a cache hit doesn't have to wait for the upstream-bound queries received before it
+server = run_scenario(0.3, ["--deadline-ms", "5000"])
+try:
+    check("cache warm-up", send_queries(["cached.example.com"], 1)[0].get(0), (RCODE_NOERROR, True))
+    names = ["upstream%d.example.com" % i for i in range(4)] + ["cached.example.com"]
+    responses, order = send_queries(names, 3)
+    check("cache hit answered", responses.get(4), (RCODE_NOERROR, True))
+    check("upstream-bound queries answered", [responses.get(id) for id in range(4)], [(RCODE_NOERROR, True)] * 4)
+    if 4 in order and 1 in order:
+        check("cache hit answered before the upstream-bound queries behind the first one", order.index(4) < order.index(1), True)
+finally:
+    stop(server)
+
+# a cache hit echoes the question and flags of the query it answers, not those of the query that filled the cache
+server = run_scenario(0, ["--deadline-ms", "5000"])
+try:
+    check("cache warm-up with another spelling", send_queries(["case.example.com"], 1)[0].get(0), (RCODE_NOERROR, True))
+    client = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    client.settimeout(2)
+    # without RD
+    query = struct.pack(">HHHHHH", 4321, 0x0000, 1, 0, 0, 0) + encode_name("CaSe.ExAmPlE.cOm") + struct.pack(">HH", TYPE_A, 1)
+    client.sendto(query, ("127.0.0.1", 2053))
+    response = client.recv(512)
+    check("cache hit ID", struct.unpack(">H", response[:2])[0], 4321)
+    check("cache hit RD", struct.unpack(">H", response[2:4])[0] & 0x0100, 0)
+    check("cache hit question", response[12 : len(query)], query[12:])
+    check("cache hit answer", socket.inet_aton("1.2.3.4") in response, True)
+finally:
+    stop(server)
+
+# forged responses are neither forwarded nor cached
+server = run_scenario(0.1, ["--deadline-ms", "5000"], spoofed_resolver)
+try:
+    check("forged responses skipped", send_queries(["spoofed.example.com"], 1)[0].get(0), (RCODE_NOERROR, True))
+    check("forged responses not cached", send_queries(["spoofed.example.com"], 1)[0].get(0), (RCODE_NOERROR, True))
+finally:
+    stop(server)
+
+if failures:
+    for failure in failures:
+        print(failure)
+    exit(1)
+
+print("no problems detected")
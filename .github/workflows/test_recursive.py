@@ -0,0 +1,254 @@
+import socket
+import struct
+import subprocess
+import threading
+import time
+
+# Stub authoritative servers on loopback, all listening on the same port
+PORT = 5354
+ROOT = "127.0.0.2"
+COM = "127.0.0.3"
+EXAMPLE_COM = "127.0.0.4"
+GLUELESS_COM = "127.0.0.5"
+
+# how long the stub servers take to answer the load test queries
+LOAD_DELAY = 0.5
+
+TYPE_A = 1
+TYPE_NS = 2
+TYPE_CNAME = 5
+TYPE_SOA = 6
+TYPE_TXT = 16
+
+CLASS_IN = 1
+CLASS_CH = 3
+
+queries_received = {ROOT: 0, COM: 0, EXAMPLE_COM: 0, GLUELESS_COM: 0}
+
+
+def encode_name(name):
+    encoded = b""
+    for label in name.split("."):
+        if label:
+            encoded += bytes([len(label)]) + label.encode()
+    return encoded + b"\0"
+
+
+def parse_name(message, offset):
+    labels = []
+    end = None
+    while message[offset] != 0:
+        if message[offset] & 0xC0 == 0xC0:
+            if end is None:
+                end = offset + 2
+            offset = struct.unpack(">H", message[offset : offset + 2])[0] & 0x3FFF
+            continue
+        labels.append(message[offset + 1 : offset + 1 + message[offset]].decode())
+        offset += 1 + message[offset]
+    return ".".join(labels).lower(), end if end is not None else offset + 1
+
+
+def record(name, type, rdata, ttl=3600):
+    if type in (TYPE_NS, TYPE_CNAME):
+        rdata = encode_name(rdata)
+    elif type == TYPE_A:
+        rdata = socket.inet_aton(rdata)
+    return encode_name(name) + struct.pack(">HHIH", type, 1, ttl, len(rdata)) + rdata
+
+
+def soa(zone):
+    rdata = encode_name("ns." + zone) + encode_name("admin." + zone) + struct.pack(">IIIII", 1, 3600, 600, 86400, 300)
+    return encode_name(zone) + struct.pack(">HHIH", TYPE_SOA, 1, 300, len(rdata)) + rdata
+
+
+def referral(zone, name_servers, glue):
+    authority = [record(zone, TYPE_NS, name_server) for name_server in name_servers]
+    additional = [record(name, TYPE_A, address) for name, address in glue]
+    return 0, False, [], authority, additional
+
+
+def root_zone(name, type):
+    if name == "com" or name.endswith(".com"):
+        return referral("com", ["a.gtld-servers.net"], [("a.gtld-servers.net", COM)])
+    return 3, True, [], [soa("")], []
+
+
+def com_zone(name, type):
+    if name == "example.com" or name.endswith(".example.com"):
+        return referral("example.com", ["ns1.example.com"], [("ns1.example.com", EXAMPLE_COM)])
+    if name == "glueless.com" or name.endswith(".glueless.com"):
+        # the name server lives in another zone, so there is no glue
+        return referral("glueless.com", ["ns.example.com"], [])
+    return 3, True, [], [soa("com")], []
+
+
+def example_com_zone(name, type):
+    records = {
+        "www.example.com": [(TYPE_A, "93.184.216.34")],
+        "alias.example.com": [(TYPE_CNAME, "www.example.com")],
+        "far-alias.example.com": [(TYPE_CNAME, "host.glueless.com")],
+        # comes with a forged record for its target, which example.com isn't authoritative for
+        "poisoning-alias.example.com": [(TYPE_CNAME, "www.glueless.com")],
+        "www.glueless.com": [(TYPE_A, "6.6.6.6")],
+        "ns.example.com": [(TYPE_A, GLUELESS_COM)],
+        "ns1.example.com": [(TYPE_A, EXAMPLE_COM)],
+        "nodata.example.com": [(TYPE_TXT, None)],
+        "truncated.example.com": [(TYPE_A, "10.0.0.3")],
+    }
+    if name == "lame.example.com":
+        # neither authoritative nor an SOA, so it doesn't prove the name has no records
+        return 0, False, [], [], []
+    if name.startswith("load-"):
+        index = int(name.split(".")[0][5:])
+        records[name] = [(TYPE_A, "10.1.%d.%d" % (index // 256, index % 256))]
+
+    answers = []
+    while name in records:
+        for record_type, rdata in records[name]:
+            if record_type == type:
+                answers.append(record(name, record_type, rdata, ttl=60))
+            elif record_type == TYPE_CNAME:
+                answers.append(record(name, record_type, rdata, ttl=60))
+        cnames = [rdata for record_type, rdata in records[name] if record_type == TYPE_CNAME]
+        if not cnames or type == TYPE_CNAME:
+            break
+        name = cnames[0]
+
+    if answers or name in records:
+        return 0, True, answers, [] if answers else [soa("example.com")], []
+    return 3, True, [], [soa("example.com")], []
+
+
+def glueless_com_zone(name, type):
+    addresses = {"host.glueless.com": "10.0.0.1", "www.glueless.com": "10.0.0.2"}
+    if name in addresses:
+        return 0, True, [record(name, TYPE_A, addresses[name], ttl=60)] if type == TYPE_A else [], [], []
+    return 3, True, [], [soa("glueless.com")], []
+
+
+def serve(address, zone):
+    server = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    server.bind((address, PORT))
+    while True:
+        query, client = server.recvfrom(512)
+        queries_received[address] += 1
+
+        id, flags, qdcount = struct.unpack(">HHH", query[:6])
+        name, offset = parse_name(query, 12)
+        type = struct.unpack(">H", query[offset : offset + 2])[0]
+
+        rcode, authoritative, answers, authority, additional = zone(name, type)
+        flags = 0x8000 | (0x0400 if authoritative else 0) | rcode
+        if name == "truncated.example.com":
+            flags |= 0x0200
+        header = struct.pack(">HHHHHH", id, flags, 1, len(answers), len(authority), len(additional))
+        response = header + query[12 : offset + 4] + b"".join(answers + authority + additional)
+
+        if name.startswith("load-"):
+            # slow enough that the test only finishes in time if the resolutions run concurrently
+            threading.Timer(LOAD_DELAY, server.sendto, (response, client)).start()
+        else:
+            server.sendto(response, client)
+
+
+def build_query(name, id, type=TYPE_A, _class=CLASS_IN):
+    return struct.pack(">HHHHHH", id, 0x0100, 1, 0, 0, 0) + encode_name(name) + struct.pack(">HH", type, _class)
+
+
+def parse_response(response):
+    id, flags, qdcount, ancount = struct.unpack(">HHHH", response[:8])
+    offset = 12
+    for _ in range(qdcount):
+        offset = parse_name(response, offset)[1] + 4
+    answers = []
+    for _ in range(ancount):
+        name, offset = parse_name(response, offset)
+        type, _class, ttl, rdlength = struct.unpack(">HHIH", response[offset : offset + 10])
+        offset += 10
+        if type == TYPE_A:
+            answers.append((name, type, socket.inet_ntoa(response[offset : offset + rdlength])))
+        elif type == TYPE_CNAME:
+            answers.append((name, type, parse_name(response, offset)[0]))
+        offset += rdlength
+    return id, flags & 0xF, answers
+
+
+def ask(name, type=TYPE_A, _class=CLASS_IN):
+    client = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    client.settimeout(5)
+    client.sendto(build_query(name, 4242, type, _class), ("127.0.0.1", 2053))
+    return parse_response(client.recv(512))[1:]
+
+
+failures = []
+
+
+def check(description, actual, expected):
+    if actual != expected:
+        failures.append(f"{description}: expected {expected}, got {actual}")
+
+
+for address, zone in [(ROOT, root_zone), (COM, com_zone), (EXAMPLE_COM, example_com_zone), (GLUELESS_COM, glueless_com_zone)]:
+    threading.Thread(target=serve, args=(address, zone), daemon=True).start()
+
+server = subprocess.Popen(
+    ["build/server", "--recursive", "--root-hints", ROOT, "--upstream-port", str(PORT), "--queue-depth", "4096", "--deadline-ms", "5000"],
+    stdout=subprocess.DEVNULL,
+)
+time.sleep(1)
+
+try:
+    check("A record", ask("www.example.com"), (0, [("www.example.com", TYPE_A, "93.184.216.34")]))
+    check("CNAME in the same zone", ask("alias.example.com"), (0, [("alias.example.com", TYPE_CNAME, "www.example.com"), ("www.example.com", TYPE_A, "93.184.216.34")]))
+    check("CNAME into a zone without glue", ask("far-alias.example.com"), (0, [("far-alias.example.com", TYPE_CNAME, "host.glueless.com"), ("host.glueless.com", TYPE_A, "10.0.0.1")]))
+    check("zone without glue", ask("host.glueless.com"), (0, [("host.glueless.com", TYPE_A, "10.0.0.1")]))
+    check("CNAME target outside of the zone resolved on its own", ask("poisoning-alias.example.com"), (0, [("poisoning-alias.example.com", TYPE_CNAME, "www.glueless.com"), ("www.glueless.com", TYPE_A, "10.0.0.2")]))
+    # www.example.com is in the answer cache by now, but only for IN
+    check("CHAOS class", ask("www.example.com", _class=CLASS_CH), (4, []))
+    check("NXDOMAIN", ask("missing.example.com"), (3, []))
+    check("NXDOMAIN at the root", ask("example.invalid"), (3, []))
+    check("NODATA", ask("nodata.example.com"), (0, []))
+    check("NODATA from a server that isn't authoritative", ask("lame.example.com"), (2, []))
+
+    # a truncated response answers the query, but isn't cached
+    for attempt in range(2):
+        before = queries_received[EXAMPLE_COM]
+        check("truncated answer %d" % attempt, ask("truncated.example.com"), (0, [("truncated.example.com", TYPE_A, "10.0.0.3")]))
+        check("truncated answer %d asked the server" % attempt, queries_received[EXAMPLE_COM] - before, 1)
+
+    # many resolutions at once, each one waiting for the stub servers
+    # the window keeps the socket buffers on the way from overflowing
+    concurrent_queries = 1000
+    window = 200
+    client = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    client.settimeout(5)
+    started = time.monotonic()
+    sent = 0
+    answered = 0
+    try:
+        while answered < concurrent_queries:
+            while sent < concurrent_queries and sent - answered < window:
+                client.sendto(build_query("load-%d.example.com" % sent, sent), ("127.0.0.1", 2053))
+                sent += 1
+            id, rcode, answers = parse_response(client.recv(512))
+            check("concurrent query %d" % id, (rcode, answers), (0, [("load-%d.example.com" % id, TYPE_A, "10.1.%d.%d" % (id // 256, id % 256))]))
+            answered += 1
+    except socket.timeout:
+        pass
+    check("answered concurrent queries", answered, concurrent_queries)
+    # resolving them one after another would take concurrent_queries * LOAD_DELAY
+    check("concurrent resolutions overlap", time.monotonic() - started < 4 * concurrent_queries / window * LOAD_DELAY, True)
+
+    # the delegations of com and example.com are cached after the first resolution,
+    # only example.invalid goes to the root server again
+    check("queries to the root server", queries_received[ROOT], 2)
+    check("queries to the com server", queries_received[COM], 2)
+finally:
+    server.kill()
+
+if failures:
+    for failure in failures:
+        print(failure)
+    exit(1)
+
+print("no problems detected")
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <cstdint>
+
+// https://en.cppreference.com/w/cpp/language/bit_field
+struct __attribute__((packed)) header_struct {
+	uint16_t id;
+	uint16_t flags;
+	uint16_t qdcount;
+	uint16_t ancount;
+	uint16_t nscount;
+	uint16_t arcount;
+
+	bool isQuery() const {
+		return (flags >> 15) & 0x1;
+	}
+
+	void setQuery(bool isQuery) {
+		if (isQuery) {
+			flags |= (0x1 << 15);
+		} else {
+			flags &= ~(0x1 << 15);
+		}
+	}
+
+	uint8_t getOpcode() const {
+		return (flags >> 11) & 0xF;
+	}
+
+	void setOpcode(uint8_t opcode) {
+		flags &= 0xF8FF;			   // Clear the 4 bits for OPCODE field
+		flags |= (opcode & 0xF) << 11; // Set the 4 bits for OPCODE field
+	}
+
+	bool isAuthoritative() const {
+		return (flags >> 10) & 0x1;
+	}
+
+	void setAuthoritative(bool isAuthoritative) {
+		if (isAuthoritative) {
+			flags |= (0x1 << 10);
+		} else {
+			flags &= ~(0x1 << 10);
+		}
+	}
+
+	bool isTruncated() const {
+		return (flags >> 9) & 0x1;
+	}
+
+	void setTruncated(bool isTruncated) {
+		if (isTruncated) {
+			flags |= (0x1 << 9);
+		} else {
+			flags &= ~(0x1 << 9);
+		}
+	}
+
+	bool isRecursionDesired() const {
+		return (flags >> 8) & 0x1;
+	}
+
+	void setRecursionDesired(bool recursionDesired) {
+		if (recursionDesired) {
+			flags |= (0x1 << 8);
+		} else {
+			flags &= ~(0x1 << 8);
+		}
+	}
+
+	bool isRecursionAvailable() const {
+		return (flags >> 7) & 0x1;
+	}
+
+	void setRecursionAvailable(bool recursionAvailable) {
+		if (recursionAvailable) {
+			flags |= (0x1 << 7);
+		} else {
+			flags &= ~(0x1 << 7);
+		}
+	}
+
+	// the lowest of the Z bits, https://www.rfc-editor.org/rfc/rfc4035#section-3.2.2
+	bool isCheckingDisabled() const {
+		return (flags >> 4) & 0x1;
+	}
+
+	void setCheckingDisabled(bool checkingDisabled) {
+		if (checkingDisabled) {
+			flags |= (0x1 << 4);
+		} else {
+			flags &= ~(0x1 << 4);
+		}
+	}
+
+	uint8_t getReserved() const {
+		return (flags >> 4) & 0x7;
+	}
+
+	void setReserved(uint8_t zField) {
+		flags &= 0xFF8F;			  // Clear the 3 bits for Z field
+		flags |= (zField & 0x7) << 4; // Set the 3 bits for Z field
+	}
+
+	uint8_t getRcode() const {
+		return flags & 0xF;
+	}
+
+	void setRcode(uint8_t rcode) {
+		flags &= 0xFFF0;	  // Clear the 4 bits for RCODE field
+		flags |= rcode & 0xF; // Set the 4 bits for RCODE field
+	}
+};
+
+typedef uint16_t (*byte_order_conversion_func)(uint16_t);
+
+inline header_struct convert_struct_byte_order(const header_struct &struct_with_network_byte_order, byte_order_conversion_func conversion_func) {
+	header_struct struct_with_host_byte_order;
+	struct_with_host_byte_order = struct_with_network_byte_order;
+	struct_with_host_byte_order.id = conversion_func(struct_with_network_byte_order.id);
+	struct_with_host_byte_order.flags = conversion_func(struct_with_network_byte_order.flags);
+	struct_with_host_byte_order.qdcount = conversion_func(struct_with_network_byte_order.qdcount);
+	struct_with_host_byte_order.ancount = conversion_func(struct_with_network_byte_order.ancount);
+	struct_with_host_byte_order.nscount = conversion_func(struct_with_network_byte_order.nscount);
+	struct_with_host_byte_order.arcount = conversion_func(struct_with_network_byte_order.arcount);
+
+	return struct_with_host_byte_order;
+}
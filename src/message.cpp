@@ -0,0 +1,235 @@
+#include <arpa/inet.h>
+#include <cctype>
+#include <cstring>
+#include <sstream>
+
+#include "message.hpp"
+
+const int MAX_POINTER_JUMPS = 32;
+
+uint16_t read_u16(const char *data) {
+	uint16_t value;
+	memcpy(&value, data, sizeof(value));
+	return ntohs(value);
+}
+
+uint32_t read_u32(const char *data) {
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+	return ntohl(value);
+}
+
+void append_u16(std::vector<char> &out, uint16_t value) {
+	out.push_back(value >> 8);
+	out.push_back(value & 0xFF);
+}
+
+void append_u32(std::vector<char> &out, uint32_t value) {
+	append_u16(out, value >> 16);
+	append_u16(out, value & 0xFFFF);
+}
+
+// Reads a possibly compressed name and moves offset past it
+// https://www.rfc-editor.org/rfc/rfc1035#section-4.1.4
+bool parse_name(const char *message, int length, int &offset, std::string &name) {
+	name.clear();
+	int position = offset;
+	bool jumped = false;
+	int jumps = 0;
+
+	while (position < length) {
+		uint8_t octet = message[position];
+
+		if (octet == 0) {
+			if (!jumped) {
+				offset = position + 1;
+			}
+			return true;
+		}
+
+		if ((0b11000000 & octet) == 0b11000000) {
+			// pointers can form loops
+			if (position + 1 >= length || ++jumps > MAX_POINTER_JUMPS) {
+				return false;
+			}
+			if (!jumped) {
+				offset = position + 2;
+			}
+			jumped = true;
+			position = ((octet & 0b00111111) << 8) | static_cast<uint8_t>(message[position + 1]);
+			continue;
+		}
+
+		if ((0b11000000 & octet) != 0 || position + 1 + octet > length) {
+			return false;
+		}
+
+		if (!name.empty()) {
+			name += '.';
+		}
+		for (int i = 0; i < octet; i++) {
+			name += std::tolower(static_cast<unsigned char>(message[position + 1 + i]));
+		}
+		// https://www.rfc-editor.org/rfc/rfc1035#section-2.3.4
+		if (name.length() > 255) {
+			return false;
+		}
+
+		position += 1 + octet;
+	}
+
+	return false;
+}
+
+void encode_name(const std::string &name, std::vector<char> &out) {
+	std::stringstream ss(name);
+	std::string label;
+	while (std::getline(ss, label, '.')) {
+		if (label.empty()) {
+			continue;
+		}
+		out.push_back(label.length());
+		out.insert(out.end(), label.begin(), label.end());
+	}
+	out.push_back(0);
+}
+
+// Copies the RDATA, expanding the compressed names of the types that may contain them
+// https://www.rfc-editor.org/rfc/rfc3597#section-4
+static bool read_rdata(const char *message, int length, int offset, uint16_t type, uint16_t rdlength, std::vector<char> &rdata) {
+	int end = offset + rdlength;
+	if (end > length) {
+		return false;
+	}
+
+	std::string name;
+	switch (type) {
+	case TYPE_NS:
+	case TYPE_CNAME:
+	case TYPE_PTR:
+		if (!parse_name(message, end, offset, name)) {
+			return false;
+		}
+		encode_name(name, rdata);
+		return true;
+	case TYPE_MX:
+		if (offset + 2 > end) {
+			return false;
+		}
+		rdata.insert(rdata.end(), message + offset, message + offset + 2);
+		offset += 2;
+		if (!parse_name(message, end, offset, name)) {
+			return false;
+		}
+		encode_name(name, rdata);
+		return true;
+	case TYPE_SOA:
+		// MNAME and RNAME, followed by five 32 bit fields
+		for (int i = 0; i < 2; i++) {
+			if (!parse_name(message, end, offset, name)) {
+				return false;
+			}
+			encode_name(name, rdata);
+		}
+		if (offset + 20 > end) {
+			return false;
+		}
+		rdata.insert(rdata.end(), message + offset, message + offset + 20);
+		return true;
+	default:
+		rdata.assign(message + offset, message + end);
+		return true;
+	}
+}
+
+static bool parse_record(const char *message, int length, int &offset, dns_record_struct &record) {
+	if (!parse_name(message, length, offset, record.name)) {
+		return false;
+	}
+	// type, class, TTL and RDLENGTH
+	if (offset + 10 > length) {
+		return false;
+	}
+
+	record.type = read_u16(message + offset);
+	record._class = read_u16(message + offset + 2);
+	record.ttl = read_u32(message + offset + 4);
+	record.ttl_offset = offset + 4;
+	uint16_t rdlength = read_u16(message + offset + 8);
+	offset += 10;
+
+	if (!read_rdata(message, length, offset, record.type, rdlength, record.rdata)) {
+		return false;
+	}
+	offset += rdlength;
+
+	return true;
+}
+
+// Returns the offset right after the question section, or -1 if the message is malformed
+int skip_question_section(const char *message, int length) {
+	if (length < (int)sizeof(header_struct)) {
+		return -1;
+	}
+
+	int offset = sizeof(header_struct);
+	std::string name;
+	for (int i = 0; i < read_u16(message + 4); i++) {
+		// type and class
+		if (!parse_name(message, length, offset, name) || offset + 4 > length) {
+			return -1;
+		}
+		offset += 4;
+	}
+
+	return offset;
+}
+
+bool parse_message(const char *message, int length, dns_message_struct &parsed) {
+	if (length < (int)sizeof(header_struct)) {
+		return false;
+	}
+
+	header_struct h_n;
+	memcpy(&h_n, message, sizeof(header_struct));
+	parsed.header = convert_struct_byte_order(h_n, ntohs);
+
+	int offset = sizeof(header_struct);
+
+	for (int i = 0; i < parsed.header.qdcount; i++) {
+		dns_question_struct question;
+		if (!parse_name(message, length, offset, question.name) || offset + 4 > length) {
+			return false;
+		}
+		question.type = read_u16(message + offset);
+		question._class = read_u16(message + offset + 2);
+		offset += 4;
+		parsed.questions.push_back(question);
+	}
+
+	std::vector<dns_record_struct> *sections[] = {&parsed.answers, &parsed.authorities, &parsed.additionals};
+	uint16_t counts[] = {parsed.header.ancount, parsed.header.nscount, parsed.header.arcount};
+	for (int section = 0; section < 3; section++) {
+		for (int i = 0; i < counts[section]; i++) {
+			dns_record_struct record;
+			if (!parse_record(message, length, offset, record)) {
+				// a truncated response still carries whatever fit
+				return parsed.header.isTruncated();
+			}
+			sections[section]->push_back(record);
+		}
+	}
+
+	return true;
+}
+
+// The TTL field of an OPT pseudo record holds EDNS flags
+// https://www.rfc-editor.org/rfc/rfc6891#section-6.1.3
+bool has_ttl(const dns_record_struct &record) {
+	return record.type != TYPE_OPT;
+}
+
+// A cached record is handed out with the time that's left, not the TTL it was received with
+uint32_t get_remaining_ttl(std::chrono::steady_clock::time_point expires_at, std::chrono::steady_clock::time_point now) {
+	return std::chrono::ceil<std::chrono::seconds>(expires_at - now).count();
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "header.hpp"
+
+// https://www.rfc-editor.org/rfc/rfc1035#section-3.2.2
+const uint16_t TYPE_A = 1;
+const uint16_t TYPE_NS = 2;
+const uint16_t TYPE_CNAME = 5;
+const uint16_t TYPE_SOA = 6;
+const uint16_t TYPE_PTR = 12;
+const uint16_t TYPE_MX = 15;
+// https://www.rfc-editor.org/rfc/rfc6891#section-6.1.1
+const uint16_t TYPE_OPT = 41;
+const uint16_t TYPE_ANY = 255;
+
+// https://www.rfc-editor.org/rfc/rfc1035#section-3.2.4
+const uint16_t CLASS_IN = 1;
+
+struct dns_question_struct {
+	std::string name;
+	uint16_t type;
+	uint16_t _class;
+};
+
+struct dns_record_struct {
+	// lower case, without the trailing dot; the root is the empty string
+	std::string name;
+	uint16_t type;
+	uint16_t _class;
+	uint32_t ttl;
+	// names in here are never compressed, so the record can be copied into any message
+	std::vector<char> rdata;
+	// where the TTL is in the message the record was parsed from
+	int ttl_offset = 0;
+};
+
+struct dns_message_struct {
+	// host byte order
+	header_struct header;
+	std::vector<dns_question_struct> questions;
+	std::vector<dns_record_struct> answers;
+	std::vector<dns_record_struct> authorities;
+	std::vector<dns_record_struct> additionals;
+};
+
+uint16_t read_u16(const char *data);
+uint32_t read_u32(const char *data);
+void append_u16(std::vector<char> &out, uint16_t value);
+void append_u32(std::vector<char> &out, uint32_t value);
+
+bool parse_name(const char *message, int length, int &offset, std::string &name);
+void encode_name(const std::string &name, std::vector<char> &out);
+int skip_question_section(const char *message, int length);
+// Names are lower case, a truncated message yields the records that fit
+bool parse_message(const char *message, int length, dns_message_struct &parsed);
+
+bool has_ttl(const dns_record_struct &record);
+uint32_t get_remaining_ttl(std::chrono::steady_clock::time_point expires_at, std::chrono::steady_clock::time_point now);
+
+// Makes room for another entry in a cache of values with an expires_at by evicting the expired ones.
+// Returns false if the cache is still full, the new entry isn't cached then.
+template <typename cache_type>
+bool make_room_in_cache(cache_type &cache, size_t max_entries, std::chrono::steady_clock::time_point now) {
+	if (cache.size() < max_entries) {
+		return true;
+	}
+
+	std::erase_if(cache, [&now](const auto &entry) { return entry.second.expires_at <= now; });
+	return cache.size() < max_entries;
+}
@@ -0,0 +1,862 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <coroutine>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+#include "resolver.hpp"
+#include "task.hpp"
+
+const int MAX_REFERRALS = 16;
+const int MAX_CNAME_HOPS = 8;
+const size_t MIN_ATTEMPTS_PER_ZONE = 3;
+// how deep resolutions of name servers without glue may nest
+const int MAX_DEPTH = 4;
+const size_t ANSWER_CACHE_MAX_ENTRIES = 65536;
+const size_t DELEGATION_CACHE_MAX_ENTRIES = 65536;
+
+bool parse_server_address(const std::string &address, int default_port, struct sockaddr_in &server) {
+	std::string ip;
+	std::string port;
+
+	std::stringstream ss(address);
+	std::getline(ss, ip, ':');
+
+	server = {};
+	server.sin_family = AF_INET;
+	server.sin_port = htons(default_port);
+	if (inet_pton(AF_INET, ip.c_str(), &server.sin_addr) != 1) {
+		return false;
+	}
+
+	if (std::getline(ss, port)) {
+		size_t parsed_length = 0;
+		int parsed_port = 0;
+		try {
+			parsed_port = std::stoi(port, &parsed_length);
+		} catch (const std::exception &) {
+			return false;
+		}
+		if (parsed_length != port.length() || parsed_port < 1 || parsed_port > 65535) {
+			return false;
+		}
+		server.sin_port = htons(parsed_port);
+	}
+
+	return true;
+}
+
+// IPv4 addresses of a.root-servers.net to m.root-servers.net
+// https://www.iana.org/domains/root/servers
+std::vector<struct sockaddr_in> get_default_root_hints(int port) {
+	const char *root_servers[] = {
+		"198.41.0.4",
+		"170.247.170.2",
+		"192.33.4.12",
+		"199.7.91.13",
+		"192.203.230.10",
+		"192.5.5.241",
+		"192.112.36.4",
+		"198.97.190.53",
+		"192.36.148.17",
+		"192.58.128.30",
+		"193.0.14.129",
+		"199.7.83.42",
+		"202.12.27.33"};
+
+	std::vector<struct sockaddr_in> root_hints;
+	for (const char *root_server : root_servers) {
+		struct sockaddr_in server;
+		parse_server_address(root_server, port, server);
+		root_hints.push_back(server);
+	}
+
+	return root_hints;
+}
+
+static bool is_subdomain(const std::string &name, const std::string &zone) {
+	if (zone.empty() || name == zone) {
+		return true;
+	}
+	return name.length() > zone.length() && name.ends_with(zone) && name[name.length() - zone.length() - 1] == '.';
+}
+
+static int count_labels(const std::string &name) {
+	if (name.empty()) {
+		return 0;
+	}
+	return std::count(name.begin(), name.end(), '.') + 1;
+}
+
+// The name in the RDATA of NS, CNAME and PTR records
+static std::string get_target_name(const dns_record_struct &record) {
+	std::string target;
+	int offset = 0;
+	parse_name(record.rdata.data(), record.rdata.size(), offset, target);
+	return target;
+}
+
+static std::string get_answer_cache_key(const std::string &name, uint16_t type) {
+	return name + "/" + std::to_string(type);
+}
+
+static std::vector<char> build_query(const std::string &name, uint16_t type) {
+	// RD stays unset, the servers we ask are expected to answer authoritatively or refer us further
+	header_struct h_h = {};
+	h_h.qdcount = 1;
+	header_struct h_n = convert_struct_byte_order(h_h, htons);
+
+	std::vector<char> query(reinterpret_cast<char *>(&h_n), reinterpret_cast<char *>(&h_n) + sizeof(header_struct));
+	encode_name(name, query);
+	append_u16(query, type);
+	append_u16(query, CLASS_IN);
+
+	return query;
+}
+
+// Only standard queries for the Internet class are resolved, the answer cache holds nothing else
+static bool is_resolvable_query(const dns_message_struct &parsed_query) {
+	return parsed_query.questions.size() == 1 && parsed_query.header.getOpcode() == 0 && parsed_query.questions[0]._class == CLASS_IN;
+}
+
+// Builds the response to the client, reusing the ID, flags and question section of its query
+static std::vector<char> build_response(const std::vector<char> &query, const dns_message_struct &parsed_query, const resolution_result_struct &result) {
+	std::vector<char> response;
+
+	header_struct h_h = parsed_query.header;
+	h_h.setQuery(true);
+	h_h.setAuthoritative(false);
+	h_h.setTruncated(false);
+	h_h.setRecursionAvailable(true);
+	h_h.setReserved(0);
+	h_h.setRcode(result.failed ? 2 : result.rcode);
+	h_h.ancount = 0;
+	h_h.nscount = 0;
+	h_h.arcount = 0;
+
+	// parse_message has already checked the question section
+	int question_end = skip_question_section(query.data(), query.size());
+	response.resize(sizeof(header_struct));
+	response.insert(response.end(), query.begin() + sizeof(header_struct), query.begin() + question_end);
+
+	for (const dns_record_struct &record : result.answers) {
+		std::vector<char> encoded;
+		encode_name(record.name, encoded);
+		append_u16(encoded, record.type);
+		append_u16(encoded, record._class);
+		append_u32(encoded, record.ttl);
+		append_u16(encoded, record.rdata.size());
+		encoded.insert(encoded.end(), record.rdata.begin(), record.rdata.end());
+
+		// https://www.rfc-editor.org/rfc/rfc1035#section-4.2.1
+		if (response.size() + encoded.size() > 512) {
+			h_h.setTruncated(true);
+			break;
+		}
+
+		response.insert(response.end(), encoded.begin(), encoded.end());
+		h_h.ancount += 1;
+	}
+
+	header_struct h_n = convert_struct_byte_order(h_h, htons);
+	memcpy(response.data(), &h_n, sizeof(header_struct));
+
+	return response;
+}
+
+static std::vector<char> build_error_response(const std::vector<char> &query, uint8_t rcode) {
+	header_struct h_h = {};
+	if (query.size() >= sizeof(header_struct)) {
+		header_struct h_n;
+		memcpy(&h_n, query.data(), sizeof(header_struct));
+		h_h = convert_struct_byte_order(h_n, ntohs);
+	}
+
+	h_h.setQuery(true);
+	h_h.setRecursionAvailable(true);
+	h_h.setRcode(rcode);
+	h_h.qdcount = 0;
+	h_h.ancount = 0;
+	h_h.nscount = 0;
+	h_h.arcount = 0;
+
+	header_struct h_n = convert_struct_byte_order(h_h, htons);
+	return std::vector<char>(reinterpret_cast<char *>(&h_n), reinterpret_cast<char *>(&h_n) + sizeof(header_struct));
+}
+
+struct pending_exchange_struct {
+	struct sockaddr_in server = {};
+	// every exchange has a socket of its own, a response has to match it, the ID and the server
+	int udpSocket = -1;
+	uint16_t id = 0;
+	std::coroutine_handle<> handle = {};
+	// stays empty if the name server didn't answer in time
+	std::vector<char> response = {};
+	std::multimap<std::chrono::steady_clock::time_point, int>::iterator timer = {};
+};
+
+// One event loop waiting for the sockets of all of its exchanges
+struct resolver_worker_struct {
+	resolver_worker_struct(recursive_resolver_struct &resolver) : resolver(resolver), random(std::random_device()()) {}
+
+	int setUp();
+	void run();
+	void startSubmittedResolutions();
+	void receiveResponse(int udpSocket);
+	void expireTimers();
+	void finishExchange(pending_exchange_struct *exchange);
+
+	recursive_resolver_struct &resolver;
+
+	int epollFd = -1;
+	// written to by submit() to wake up the event loop
+	int wakeupFd = -1;
+
+	std::thread thread;
+	std::atomic<bool> stopping = false;
+
+	std::mutex submissions_mutex;
+	std::vector<resolution_request_struct> submissions;
+
+	// only touched by this worker's thread, keyed by socket
+	std::unordered_map<int, pending_exchange_struct *> pending_exchanges;
+	std::multimap<std::chrono::steady_clock::time_point, int> timers;
+	std::mt19937 random;
+};
+
+// Sends a query and suspends the coroutine until the matching response arrives or the timeout passes
+struct udp_exchange_awaitable {
+	resolver_worker_struct &worker;
+	std::vector<char> request;
+	std::chrono::steady_clock::time_point timeout_at;
+	pending_exchange_struct exchange;
+
+	bool await_ready() {
+		return false;
+	}
+
+	// Returning false resumes the coroutine right away, as if the server hadn't answered
+	bool await_suspend(std::coroutine_handle<> handle) {
+		// a fresh socket gets a random source port from the kernel, so a spoofed response has to guess it as well as the ID
+		// https://www.rfc-editor.org/rfc/rfc5452#section-9.2
+		exchange.udpSocket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (exchange.udpSocket == -1) {
+			perror("Failed to create socket for name server query");
+			return false;
+		}
+
+		// the ID has to be unpredictable as well
+		// https://www.rfc-editor.org/rfc/rfc5452#section-9.1
+		if (getrandom(&exchange.id, sizeof(exchange.id), 0) != sizeof(exchange.id)) {
+			perror("getrandom failed");
+			close(exchange.udpSocket);
+			return false;
+		}
+		uint16_t id_n = htons(exchange.id);
+		memcpy(request.data(), &id_n, sizeof(id_n));
+
+		struct epoll_event event = {};
+		event.events = EPOLLIN;
+		event.data.fd = exchange.udpSocket;
+		if (epoll_ctl(worker.epollFd, EPOLL_CTL_ADD, exchange.udpSocket, &event) == -1) {
+			perror("epoll_ctl failed");
+			close(exchange.udpSocket);
+			return false;
+		}
+
+		if (sendto(exchange.udpSocket, request.data(), request.size(), 0, reinterpret_cast<struct sockaddr *>(&exchange.server), sizeof(exchange.server)) == -1) {
+			perror("Failed to send query to name server");
+			close(exchange.udpSocket);
+			return false;
+		}
+
+		exchange.handle = handle;
+		exchange.timer = worker.timers.emplace(timeout_at, exchange.udpSocket);
+		worker.pending_exchanges[exchange.udpSocket] = &exchange;
+
+		return true;
+	}
+
+	std::vector<char> await_resume() {
+		return std::move(exchange.response);
+	}
+};
+
+// An NS record delegating a zone closer to name than the zone of the server that sent it
+static bool is_referral_record(const dns_record_struct &record, const std::string &zone, const std::string &name) {
+	return record.type == TYPE_NS && is_subdomain(name, record.name) && count_labels(record.name) > count_labels(zone);
+}
+
+// A usable response is NXDOMAIN, an answer, a referral or an authoritative NODATA.
+// Anything else comes from a lame or misconfigured server.
+static bool is_usable_response(const dns_message_struct &response, const std::string &zone, const std::string &name, uint16_t type) {
+	if (response.header.getRcode() == 3) {
+		return true;
+	}
+	for (const dns_record_struct &record : response.answers) {
+		if (record.name == name && (record.type == type || record.type == TYPE_CNAME || type == TYPE_ANY)) {
+			return true;
+		}
+	}
+	for (const dns_record_struct &record : response.authorities) {
+		if (is_referral_record(record, zone, name)) {
+			return true;
+		}
+	}
+
+	// the records that didn't fit might have been the answer
+	if (response.header.isTruncated()) {
+		return false;
+	}
+
+	// https://www.rfc-editor.org/rfc/rfc2308#section-2.2
+	if (response.header.isAuthoritative()) {
+		return true;
+	}
+	for (const dns_record_struct &record : response.authorities) {
+		if (record.type == TYPE_SOA && is_subdomain(name, record.name) && is_subdomain(record.name, zone)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Asks the name servers of zone one after another until one of them gives a usable response
+static task<std::optional<dns_message_struct>> query_servers(resolver_worker_struct &worker, std::vector<struct sockaddr_in> servers, std::string zone, std::string name, uint16_t type, std::chrono::steady_clock::time_point deadline) {
+	std::vector<char> request = build_query(name, type);
+
+	// spread the load over all name servers of a zone
+	size_t first = servers.empty() ? 0 : worker.random() % servers.size();
+
+	// UDP gets lost, so a zone with few name servers gets asked more than once
+	size_t attempts = std::max<size_t>(servers.size(), MIN_ATTEMPTS_PER_ZONE);
+	for (size_t i = 0; i < attempts && !servers.empty(); i++) {
+		auto now = std::chrono::steady_clock::now();
+		if (now >= deadline) {
+			break;
+		}
+
+		auto timeout_at = std::min(deadline, now + std::chrono::milliseconds(worker.resolver.config.server_timeout_ms));
+		// a named awaitable, GCC 12 destroys aggregate temporaries in co_await expressions twice
+		udp_exchange_awaitable exchange{worker, request, timeout_at, {servers[(first + i) % servers.size()]}};
+		std::vector<char> response = co_await exchange;
+		if (response.empty()) {
+			continue;
+		}
+
+		dns_message_struct parsed;
+		if (!parse_message(response.data(), response.size(), parsed) || !parsed.header.isQuery()) {
+			continue;
+		}
+		if (parsed.questions.size() != 1 || parsed.questions[0].name != name || parsed.questions[0].type != type) {
+			continue;
+		}
+
+		// SERVFAIL, REFUSED and the like: another server of the zone might do better
+		if (parsed.header.getRcode() != 0 && parsed.header.getRcode() != 3) {
+			continue;
+		}
+		if (!is_usable_response(parsed, zone, name, type)) {
+			continue;
+		}
+
+		co_return parsed;
+	}
+
+	co_return std::nullopt;
+}
+
+// Appends the records answering name to chain, following CNAMEs within the response as long as they stay in zone.
+// Returns the name the chain ends at.
+static std::string collect_answers(const dns_message_struct &response, const std::string &zone, std::string name, uint16_t type, std::vector<dns_record_struct> &chain, bool &answered) {
+	for (int hops = 0; hops <= MAX_CNAME_HOPS; hops++) {
+		for (const dns_record_struct &record : response.answers) {
+			if (record.name == name && (record.type == type || type == TYPE_ANY)) {
+				chain.push_back(record);
+				answered = true;
+			}
+		}
+		if (answered || type == TYPE_CNAME) {
+			return name;
+		}
+
+		bool followed = false;
+		for (const dns_record_struct &record : response.answers) {
+			if (record.name == name && record.type == TYPE_CNAME) {
+				chain.push_back(record);
+				name = get_target_name(record);
+				followed = true;
+				break;
+			}
+		}
+		// records for a target outside of the zone of the server that sent them can't be trusted,
+		// it has to be resolved on its own
+		// https://www.rfc-editor.org/rfc/rfc5452#section-6
+		if (!followed || !is_subdomain(name, zone)) {
+			return name;
+		}
+	}
+
+	return name;
+}
+
+static task<resolution_result_struct> resolve(resolver_worker_struct &worker, std::string name, uint16_t type, std::chrono::steady_clock::time_point deadline, int depth) {
+	resolution_result_struct result;
+
+	if (depth > MAX_DEPTH) {
+		co_return result;
+	}
+
+	if (worker.resolver.lookupAnswerCache(name, type, result)) {
+		co_return result;
+	}
+
+	std::vector<dns_record_struct> chain;
+	std::string current_name = name;
+
+	for (int cname_hops = 0; cname_hops <= MAX_CNAME_HOPS; cname_hops++) {
+		std::string zone;
+		std::vector<struct sockaddr_in> servers;
+		worker.resolver.findClosestDelegation(current_name, zone, servers);
+
+		bool restart = false;
+		for (int referrals = 0; referrals < MAX_REFERRALS && !restart; referrals++) {
+			std::optional<dns_message_struct> response = co_await query_servers(worker, servers, zone, current_name, type, deadline);
+			if (!response) {
+				co_return result;
+			}
+
+			// https://www.rfc-editor.org/rfc/rfc1035#section-4.1.1
+			if (response->header.getRcode() == 3) {
+				result.failed = false;
+				result.rcode = 3;
+				result.answers = chain;
+				co_return result;
+			}
+
+			// a truncated response is good enough to carry on with, but it may lack records, so nothing of it is cached
+			bool truncated = response->header.isTruncated();
+
+			bool answered = false;
+			std::string chain_end = collect_answers(*response, zone, current_name, type, chain, answered);
+			if (answered) {
+				result.failed = false;
+				result.rcode = 0;
+				result.answers = chain;
+				if (!truncated) {
+					worker.resolver.storeAnswer(name, type, result);
+				}
+				co_return result;
+			}
+			if (chain_end != current_name) {
+				// the CNAME target may live in a different zone
+				current_name = chain_end;
+				restart = true;
+				continue;
+			}
+
+			// a referral delegates a zone closer to the name than the one we just asked
+			std::string child_zone;
+			std::vector<std::string> name_servers;
+			uint32_t ttl = std::numeric_limits<uint32_t>::max();
+			for (const dns_record_struct &record : response->authorities) {
+				if (!is_referral_record(record, zone, current_name)) {
+					continue;
+				}
+				if (!child_zone.empty() && record.name != child_zone) {
+					continue;
+				}
+				child_zone = record.name;
+				name_servers.push_back(get_target_name(record));
+				ttl = std::min(ttl, record.ttl);
+			}
+
+			if (name_servers.empty()) {
+				// the name exists, but has no records of this type; query_servers only lets authoritative NODATA through
+				result.failed = false;
+				result.rcode = response->header.getRcode();
+				result.answers = chain;
+				co_return result;
+			}
+
+			std::vector<struct sockaddr_in> child_servers;
+			for (const dns_record_struct &record : response->additionals) {
+				// glue outside of the zone of the server that sent it can't be trusted
+				// https://www.rfc-editor.org/rfc/rfc9471
+				if (record.type != TYPE_A || record.rdata.size() != 4 || !is_subdomain(record.name, zone)) {
+					continue;
+				}
+				if (std::find(name_servers.begin(), name_servers.end(), record.name) == name_servers.end()) {
+					continue;
+				}
+
+				struct sockaddr_in server = {};
+				server.sin_family = AF_INET;
+				server.sin_port = htons(worker.resolver.config.upstream_port);
+				memcpy(&server.sin_addr, record.rdata.data(), 4);
+				child_servers.push_back(server);
+				ttl = std::min(ttl, record.ttl);
+			}
+
+			if (child_servers.empty()) {
+				// no glue, the addresses of the name servers have to be resolved first
+				for (const std::string &name_server : name_servers) {
+					// a name server inside the delegated zone can't be found without glue
+					if (is_subdomain(name_server, child_zone)) {
+						continue;
+					}
+
+					resolution_result_struct name_server_result = co_await resolve(worker, name_server, TYPE_A, deadline, depth + 1);
+					for (const dns_record_struct &record : name_server_result.answers) {
+						if (record.type == TYPE_A && record.rdata.size() == 4) {
+							struct sockaddr_in server = {};
+							server.sin_family = AF_INET;
+							server.sin_port = htons(worker.resolver.config.upstream_port);
+							memcpy(&server.sin_addr, record.rdata.data(), 4);
+							child_servers.push_back(server);
+							ttl = std::min(ttl, record.ttl);
+						}
+					}
+					if (!child_servers.empty()) {
+						break;
+					}
+				}
+			}
+
+			if (child_servers.empty()) {
+				printf("No reachable name server for %s\n", child_zone.c_str());
+				co_return result;
+			}
+
+			printf("Following referral for %s to %s\n", current_name.c_str(), child_zone.c_str());
+			if (!truncated) {
+				worker.resolver.storeDelegation(child_zone, child_servers, ttl);
+			}
+			zone = child_zone;
+			servers = child_servers;
+		}
+
+		if (!restart) {
+			// too many referrals
+			co_return result;
+		}
+	}
+
+	co_return result;
+}
+
+static detached_task run_resolution(resolver_worker_struct &worker, resolution_request_struct request) {
+	std::vector<char> response;
+
+	dns_message_struct parsed_query;
+	if (!parse_message(request.query.data(), request.query.size(), parsed_query) || parsed_query.questions.size() != 1) {
+		// FORMERR
+		response = build_error_response(request.query, 1);
+	} else if (!is_resolvable_query(parsed_query)) {
+		// NOTIMP, for other opcodes as well as CH, HS and the like
+		response = build_error_response(request.query, 4);
+	} else {
+		const dns_question_struct &question = parsed_query.questions[0];
+		resolution_result_struct result = co_await resolve(worker, question.name, question.type, request.deadline, 0);
+
+		// an empty response lets the caller shed the query
+		if (std::chrono::steady_clock::now() <= request.deadline) {
+			response = build_response(request.query, parsed_query, result);
+		}
+	}
+
+	worker.resolver.callback(request, response);
+	worker.resolver.in_flight -= 1;
+}
+
+int resolver_worker_struct::setUp() {
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epollFd == -1 || wakeupFd == -1) {
+		std::cerr << "Resolver setup failed: " << strerror(errno) << std::endl;
+		return 1;
+	}
+
+	struct epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.fd = wakeupFd;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeupFd, &event) == -1) {
+		std::cerr << "epoll_ctl failed: " << strerror(errno) << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
+
+void resolver_worker_struct::run() {
+	struct epoll_event events[16];
+
+	while (!stopping) {
+		int timeout_ms = -1;
+		if (!timers.empty()) {
+			auto until_next_timer = timers.begin()->first - std::chrono::steady_clock::now();
+			timeout_ms = std::max<long>(0, std::chrono::ceil<std::chrono::milliseconds>(until_next_timer).count());
+		}
+
+		int event_count = epoll_wait(epollFd, events, 16, timeout_ms);
+		if (event_count == -1 && errno != EINTR) {
+			perror("epoll_wait failed");
+			break;
+		}
+
+		for (int i = 0; i < event_count; i++) {
+			if (events[i].data.fd == wakeupFd) {
+				startSubmittedResolutions();
+			} else {
+				receiveResponse(events[i].data.fd);
+			}
+		}
+
+		expireTimers();
+	}
+}
+
+void resolver_worker_struct::startSubmittedResolutions() {
+	uint64_t count;
+	read(wakeupFd, &count, sizeof(count));
+
+	std::vector<resolution_request_struct> requests;
+	{
+		std::lock_guard<std::mutex> lock(submissions_mutex);
+		requests.swap(submissions);
+	}
+
+	for (resolution_request_struct &request : requests) {
+		// runs until the first query to a name server is sent
+		run_resolution(*this, std::move(request));
+	}
+}
+
+void resolver_worker_struct::receiveResponse(int udpSocket) {
+	char response[512];
+	struct sockaddr_in server;
+
+	while (true) {
+		// the exchange may have finished while handling an earlier event of the same epoll_wait
+		auto entry = pending_exchanges.find(udpSocket);
+		if (entry == pending_exchanges.end()) {
+			return;
+		}
+		pending_exchange_struct *exchange = entry->second;
+
+		socklen_t serverAddrLen = sizeof(server);
+		int bytesRead = recvfrom(udpSocket, response, sizeof(response), 0, reinterpret_cast<struct sockaddr *>(&server), &serverAddrLen);
+		if (bytesRead == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("Error receiving response from name server");
+			}
+			return;
+		}
+
+		// anything else is a spoofed or misdirected response, keep waiting for the real one
+		if (bytesRead < (int)sizeof(header_struct) || read_u16(response) != exchange->id || server.sin_addr.s_addr != exchange->server.sin_addr.s_addr || server.sin_port != exchange->server.sin_port) {
+			continue;
+		}
+
+		exchange->response.assign(response, response + bytesRead);
+		finishExchange(exchange);
+		return;
+	}
+}
+
+void resolver_worker_struct::expireTimers() {
+	auto now = std::chrono::steady_clock::now();
+
+	while (!timers.empty() && timers.begin()->first <= now) {
+		finishExchange(pending_exchanges[timers.begin()->second]);
+	}
+}
+
+void resolver_worker_struct::finishExchange(pending_exchange_struct *exchange) {
+	pending_exchanges.erase(exchange->udpSocket);
+	timers.erase(exchange->timer);
+	// closing the socket removes it from the epoll instance as well
+	close(exchange->udpSocket);
+
+	exchange->handle.resume();
+}
+
+recursive_resolver_struct::recursive_resolver_struct(const resolver_config_struct &config, resolution_callback callback) : config(config), callback(callback) {
+	delegation_cache[""] = {config.root_hints, std::chrono::steady_clock::time_point::max()};
+
+	// every exchange has a socket of its own, so the soft limit of open files would cap the concurrent resolutions
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+int recursive_resolver_struct::start() {
+	for (int i = 0; i < std::max(1, config.threads); i++) {
+		std::unique_ptr<resolver_worker_struct> worker = std::make_unique<resolver_worker_struct>(*this);
+		if (worker->setUp()) {
+			close(worker->epollFd);
+			close(worker->wakeupFd);
+			continue;
+		}
+		resolver_worker_struct *worker_ptr = worker.get();
+		worker->thread = std::thread([worker_ptr]() { worker_ptr->run(); });
+		workers.push_back(std::move(worker));
+	}
+
+	if (workers.empty()) {
+		std::cerr << "Failed to start any resolver thread" << std::endl;
+		return 1;
+	}
+
+	printf("Started %zu resolver threads with %zu root hints\n", workers.size(), config.root_hints.size());
+
+	return 0;
+}
+
+recursive_resolver_struct::~recursive_resolver_struct() {
+	for (std::unique_ptr<resolver_worker_struct> &worker : workers) {
+		worker->stopping = true;
+		uint64_t one = 1;
+		write(worker->wakeupFd, &one, sizeof(one));
+		worker->thread.join();
+
+		for (auto &[udpSocket, exchange] : worker->pending_exchanges) {
+			close(udpSocket);
+		}
+		close(worker->epollFd);
+		close(worker->wakeupFd);
+	}
+}
+
+bool recursive_resolver_struct::submit(resolution_request_struct request) {
+	if (workers.empty()) {
+		return false;
+	}
+	if (in_flight.fetch_add(1) >= config.max_in_flight) {
+		in_flight -= 1;
+		return false;
+	}
+
+	resolver_worker_struct &worker = *workers[next_worker.fetch_add(1) % workers.size()];
+	{
+		std::lock_guard<std::mutex> lock(worker.submissions_mutex);
+		worker.submissions.push_back(std::move(request));
+	}
+
+	uint64_t one = 1;
+	write(worker.wakeupFd, &one, sizeof(one));
+
+	return true;
+}
+
+bool recursive_resolver_struct::hasCachedAnswer(const char *query, int length) {
+	// called for every received query, so no response is built here
+	dns_message_struct parsed_query;
+	if (!parse_message(query, length, parsed_query) || !is_resolvable_query(parsed_query)) {
+		return false;
+	}
+
+	resolution_result_struct result;
+	return lookupAnswerCache(parsed_query.questions[0].name, parsed_query.questions[0].type, result);
+}
+
+bool recursive_resolver_struct::answerFromCache(const char *query, int length, std::vector<char> &response) {
+	dns_message_struct parsed_query;
+	if (!parse_message(query, length, parsed_query) || !is_resolvable_query(parsed_query)) {
+		return false;
+	}
+
+	resolution_result_struct result;
+	if (!lookupAnswerCache(parsed_query.questions[0].name, parsed_query.questions[0].type, result)) {
+		return false;
+	}
+
+	response = build_response(std::vector<char>(query, query + length), parsed_query, result);
+	return true;
+}
+
+bool recursive_resolver_struct::lookupAnswerCache(const std::string &name, uint16_t type, resolution_result_struct &result) {
+	std::shared_lock<std::shared_mutex> lock(answer_cache_mutex);
+
+	auto entry = answer_cache.find(get_answer_cache_key(name, type));
+	auto now = std::chrono::steady_clock::now();
+	if (entry == answer_cache.end() || entry->second.expires_at <= now) {
+		return false;
+	}
+
+	result = entry->second.result;
+	uint32_t remaining = get_remaining_ttl(entry->second.expires_at, now);
+	for (dns_record_struct &record : result.answers) {
+		record.ttl = std::min(record.ttl, remaining);
+	}
+
+	return true;
+}
+
+void recursive_resolver_struct::storeAnswer(const std::string &name, uint16_t type, const resolution_result_struct &result) {
+	uint32_t ttl = std::numeric_limits<uint32_t>::max();
+	for (const dns_record_struct &record : result.answers) {
+		ttl = std::min(ttl, record.ttl);
+	}
+	if (result.answers.empty() || ttl == 0) {
+		return;
+	}
+
+	auto now = std::chrono::steady_clock::now();
+
+	std::unique_lock<std::shared_mutex> lock(answer_cache_mutex);
+	if (!make_room_in_cache(answer_cache, ANSWER_CACHE_MAX_ENTRIES, now)) {
+		return;
+	}
+
+	answer_cache[get_answer_cache_key(name, type)] = {result, now + std::chrono::seconds(ttl)};
+}
+
+void recursive_resolver_struct::findClosestDelegation(const std::string &name, std::string &zone, std::vector<struct sockaddr_in> &servers) {
+	std::shared_lock<std::shared_mutex> lock(delegation_cache_mutex);
+
+	auto now = std::chrono::steady_clock::now();
+	zone = name;
+	while (true) {
+		auto entry = delegation_cache.find(zone);
+		if (entry != delegation_cache.end() && entry->second.expires_at > now) {
+			servers = entry->second.servers;
+			return;
+		}
+
+		// strip the leftmost label, the root is always cached
+		size_t dot = zone.find('.');
+		zone = dot == std::string::npos ? "" : zone.substr(dot + 1);
+	}
+}
+
+void recursive_resolver_struct::storeDelegation(const std::string &zone, const std::vector<struct sockaddr_in> &servers, uint32_t ttl) {
+	if (zone.empty() || ttl == 0) {
+		return;
+	}
+
+	auto now = std::chrono::steady_clock::now();
+
+	std::unique_lock<std::shared_mutex> lock(delegation_cache_mutex);
+	if (!make_room_in_cache(delegation_cache, DELEGATION_CACHE_MAX_ENTRIES, now)) {
+		return;
+	}
+
+	delegation_cache[zone] = {servers, now + std::chrono::seconds(ttl)};
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "message.hpp"
+
+struct resolver_config_struct {
+	// where iterative resolution starts, usually the root servers
+	std::vector<struct sockaddr_in> root_hints;
+	// port of the name servers learned from referrals
+	int upstream_port = 53;
+	// number of event loops, each running any number of resolutions
+	int threads = 2;
+	// further queries are rejected by submit()
+	size_t max_in_flight = 10000;
+	// how long to wait for a single name server before trying the next one
+	int server_timeout_ms = 800;
+};
+
+struct resolution_result_struct {
+	bool failed = true;
+	uint8_t rcode = 2;
+	// the CNAME chain followed by the records of the requested type
+	std::vector<dns_record_struct> answers;
+};
+
+struct resolution_request_struct {
+	std::vector<char> query;
+	struct sockaddr_in client_address;
+	std::chrono::steady_clock::time_point deadline;
+};
+
+// Called on a resolver thread once a resolution is finished.
+// The response is empty if the deadline passed before the resolution finished.
+typedef std::function<void(const resolution_request_struct &request, const std::vector<char> &response)> resolution_callback;
+
+struct delegation_struct {
+	std::vector<struct sockaddr_in> servers;
+	std::chrono::steady_clock::time_point expires_at;
+};
+
+struct cached_answer_struct {
+	resolution_result_struct result;
+	std::chrono::steady_clock::time_point expires_at;
+};
+
+bool parse_server_address(const std::string &address, int default_port, struct sockaddr_in &server);
+std::vector<struct sockaddr_in> get_default_root_hints(int port);
+
+struct resolver_worker_struct;
+
+// Iterative resolver that starts at the root hints and follows referrals.
+// Every resolution is a coroutine that is suspended while it waits for a name server,
+// so a few threads are enough for many concurrent resolutions.
+struct recursive_resolver_struct {
+	recursive_resolver_struct(const resolver_config_struct &config, resolution_callback callback);
+	~recursive_resolver_struct();
+
+	// Starts the event loops, returns 1 if not even one of them could be set up
+	int start();
+
+	// Returns false if too many resolutions are in flight already
+	bool submit(resolution_request_struct request);
+
+	bool hasCachedAnswer(const char *query, int length);
+	bool answerFromCache(const char *query, int length, std::vector<char> &response);
+
+	bool lookupAnswerCache(const std::string &name, uint16_t type, resolution_result_struct &result);
+	void storeAnswer(const std::string &name, uint16_t type, const resolution_result_struct &result);
+
+	// Finds the deepest zone enclosing name whose name servers are known; the root is always known
+	void findClosestDelegation(const std::string &name, std::string &zone, std::vector<struct sockaddr_in> &servers);
+	void storeDelegation(const std::string &zone, const std::vector<struct sockaddr_in> &servers, uint32_t ttl);
+
+	resolver_config_struct config;
+	resolution_callback callback;
+	std::atomic<size_t> in_flight = 0;
+
+  private:
+	std::shared_mutex delegation_cache_mutex;
+	std::unordered_map<std::string, delegation_struct> delegation_cache;
+
+	std::shared_mutex answer_cache_mutex;
+	std::unordered_map<std::string, cached_answer_struct> answer_cache;
+
+	std::vector<std::unique_ptr<resolver_worker_struct>> workers;
+	std::atomic<size_t> next_worker = 0;
+};
@@ -1,120 +1,65 @@
 #include <arpa/inet.h>
 #include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <climits>
 #include <cstdint>
 #include <cstring>
+#include <ctime>
+#include <deque>
 #include <ios>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <netinet/in.h>
 #include <sstream>
 #include <stdio.h>
 #include <string>
 #include <strings.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <unordered_map>
 #include <vector>
 
+#include "header.hpp"
+#include "resolver.hpp"
+
 typedef enum udp_connection_type_enum { client,
 										server } udp_connection_type;
 
-// https://en.cppreference.com/w/cpp/language/bit_field
-struct __attribute__((packed)) header_struct {
-	uint16_t id;
-	uint16_t flags;
-	uint16_t qdcount;
-	uint16_t ancount;
-	uint16_t nscount;
-	uint16_t arcount;
-
-	bool isQuery() const {
-		return (flags >> 15) & 0x1;
-	}
-
-	void setQuery(bool isQuery) {
-		if (isQuery) {
-			flags |= (0x1 << 15);
-		} else {
-			flags &= ~(0x1 << 15);
-		}
-	}
-
-	uint8_t getOpcode() const {
-		return (flags >> 11) & 0xF;
-	}
-
-	void setOpcode(uint8_t opcode) {
-		flags &= 0xF8FF;			   // Clear the 4 bits for OPCODE field
-		flags |= (opcode & 0xF) << 11; // Set the 4 bits for OPCODE field
-	}
-
-	bool isAuthoritative() const {
-		return (flags >> 10) & 0x1;
-	}
-
-	void setAuthoritative(bool isAuthoritative) {
-		if (isAuthoritative) {
-			flags |= (0x1 << 10);
-		} else {
-			flags &= ~(0x1 << 10);
-		}
-	}
-
-	bool isTruncated() const {
-		return (flags >> 9) & 0x1;
-	}
-
-	void setTruncated(bool isTruncated) {
-		if (isTruncated) {
-			flags |= (0x1 << 9);
-		} else {
-			flags &= ~(0x1 << 9);
-		}
-	}
-
-	bool isRecursionDesired() const {
-		return (flags >> 8) & 0x1;
-	}
-
-	void setRecursionDesired(bool recursionDesired) {
-		if (recursionDesired) {
-			flags |= (0x1 << 8);
-		} else {
-			flags &= ~(0x1 << 8);
-		}
-	}
-
-	bool isRecursionAvailable() const {
-		return (flags >> 7) & 0x1;
-	}
-
-	void setRecursionAvailable(bool recursionAvailable) {
-		if (recursionAvailable) {
-			flags |= (0x1 << 7);
-		} else {
-			flags &= ~(0x1 << 7);
-		}
-	}
+// What to do with a query that can't be answered in time
+typedef enum shed_policy_enum { drop_query,
+								answer_servfail,
+								answer_refused } shed_policy;
+
+struct overload_config_struct {
+	// queries that waited longer than this are shed instead of answered
+	int deadline_ms = 1000;
+	// maximum number of queries waiting in each internal queue
+	size_t queue_depth = 256;
+	// SO_RCVBUF of the listening socket, 0 keeps the kernel default
+	int socket_buffer_bytes = 0;
+	shed_policy policy = answer_servfail;
+};
 
-	uint8_t getReserved() const {
-		return (flags >> 4) & 0x7;
-	}
+struct pending_query_struct {
+	char data[512];
+	int length;
+	struct sockaddr_in address;
+	// CLOCK_REALTIME, as reported by SO_TIMESTAMPNS
+	struct timespec received_at;
+};
 
-	void setReserved(uint8_t zField) {
-		flags &= 0xFF8F;			  // Clear the 3 bits for Z field
-		flags |= (zField & 0x7) << 4; // Set the 3 bits for Z field
-	}
+struct cached_response_struct {
+	std::vector<char> response;
+	std::chrono::steady_clock::time_point expires_at;
+};
 
-	uint8_t getRcode() const {
-		return flags & 0xF;
-	}
+typedef std::unordered_map<std::string, cached_response_struct> response_cache;
 
-	void setRcode(uint8_t rcode) {
-		flags &= 0xFFF0;	  // Clear the 4 bits for RCODE field
-		flags |= rcode & 0xF; // Set the 4 bits for RCODE field
-	}
-};
+const size_t RESPONSE_CACHE_MAX_ENTRIES = 4096;
 
 struct __attribute__((packed)) question_struct {
 	char name[512];
@@ -131,21 +76,6 @@ struct __attribute__((packed)) answer_struct {
 	char data[512];
 };
 
-typedef uint16_t (*byte_order_conversion_func)(uint16_t);
-
-header_struct convert_struct_byte_order(const header_struct &struct_with_network_byte_order, byte_order_conversion_func conversion_func) {
-	header_struct struct_with_host_byte_order;
-	struct_with_host_byte_order = struct_with_network_byte_order;
-	struct_with_host_byte_order.id = conversion_func(struct_with_network_byte_order.id);
-	struct_with_host_byte_order.flags = conversion_func(struct_with_network_byte_order.flags);
-	struct_with_host_byte_order.qdcount = conversion_func(struct_with_network_byte_order.qdcount);
-	struct_with_host_byte_order.ancount = conversion_func(struct_with_network_byte_order.ancount);
-	struct_with_host_byte_order.nscount = conversion_func(struct_with_network_byte_order.nscount);
-	struct_with_host_byte_order.arcount = conversion_func(struct_with_network_byte_order.arcount);
-
-	return struct_with_host_byte_order;
-}
-
 void print_header_struct(const header_struct &hs) {
 	// used Wiresark to determine that ID uses a different byte order than my system
 	// this applies to all uint16_t fields
@@ -443,6 +373,197 @@ void add_answer_section(std::string question, header_struct &h_h, char *response
 	memcpy(response, &h_n, sizeof(header_struct));
 }
 
+// Finds the smallest TTL of all resource records in the message, which is how long the message may be cached
+bool find_min_ttl(const dns_message_struct &message, uint32_t &min_ttl) {
+	bool found_ttl = false;
+	for (const std::vector<dns_record_struct> *section : {&message.answers, &message.authorities, &message.additionals}) {
+		for (const dns_record_struct &record : *section) {
+			if (!has_ttl(record)) {
+				continue;
+			}
+
+			if (!found_ttl || record.ttl < min_ttl) {
+				min_ttl = record.ttl;
+				found_ttl = true;
+			}
+		}
+	}
+
+	return found_ttl;
+}
+
+// Lowers the TTL of every resource record to at most max_ttl
+void limit_ttls(char *message, int length, uint32_t max_ttl) {
+	dns_message_struct parsed;
+	if (!parse_message(message, length, parsed)) {
+		return;
+	}
+
+	for (const std::vector<dns_record_struct> *section : {&parsed.answers, &parsed.authorities, &parsed.additionals}) {
+		for (const dns_record_struct &record : *section) {
+			if (has_ttl(record) && record.ttl > max_ttl) {
+				uint32_t ttl = htonl(max_ttl);
+				memcpy(message + record.ttl_offset, &ttl, sizeof(ttl));
+			}
+		}
+	}
+}
+
+// Queries for the same name, type and class share a key; parse_message lowers the case of names
+// https://www.rfc-editor.org/rfc/rfc4343
+bool get_response_cache_key(const char *message, int length, std::string &key) {
+	dns_message_struct parsed;
+	if (!parse_message(message, length, parsed) || parsed.questions.size() != 1 || parsed.header.getOpcode() != 0) {
+		return false;
+	}
+
+	const dns_question_struct &question = parsed.questions[0];
+	key = question.name + '/' + std::to_string(question.type) + '/' + std::to_string(question._class);
+
+	return true;
+}
+
+// Answers the request with the records of a cached response. The header and question section come from the request,
+// so the client gets its own ID, flags and spelling of the name back.
+// Returns the length of the response, or -1 if the cached records can't be combined with the request.
+int build_cached_response(const char *request, int requestLength, const std::vector<char> &cached, char *response, int responseBufferSize) {
+	int requestQuestionEnd = skip_question_section(request, requestLength);
+	int cachedQuestionEnd = skip_question_section(cached.data(), cached.size());
+	// compression pointers in the cached records point into the cached question section
+	if (requestQuestionEnd == -1 || requestQuestionEnd != cachedQuestionEnd) {
+		return -1;
+	}
+
+	int responseSize = requestQuestionEnd + (cached.size() - cachedQuestionEnd);
+	if (responseSize > responseBufferSize) {
+		return -1;
+	}
+
+	header_struct h_n;
+	memcpy(&h_n, request, sizeof(header_struct));
+	header_struct request_h = convert_struct_byte_order(h_n, ntohs);
+	memcpy(&h_n, cached.data(), sizeof(header_struct));
+	header_struct h_h = convert_struct_byte_order(h_n, ntohs);
+
+	h_h.id = request_h.id;
+	h_h.setRecursionDesired(request_h.isRecursionDesired());
+	h_h.setCheckingDisabled(request_h.isCheckingDisabled());
+	h_h.qdcount = request_h.qdcount;
+
+	h_n = convert_struct_byte_order(h_h, htons);
+	memcpy(response, &h_n, sizeof(header_struct));
+	memcpy(response + sizeof(header_struct), request + sizeof(header_struct), requestQuestionEnd - sizeof(header_struct));
+	memcpy(response + requestQuestionEnd, cached.data() + cachedQuestionEnd, cached.size() - cachedQuestionEnd);
+
+	return responseSize;
+}
+
+bool lookup_response_cache(response_cache &cache, const std::string &key) {
+	auto entry = cache.find(key);
+	if (entry == cache.end()) {
+		return false;
+	}
+	if (entry->second.expires_at <= std::chrono::steady_clock::now()) {
+		cache.erase(entry);
+		return false;
+	}
+	return true;
+}
+
+void store_in_response_cache(response_cache &cache, const std::string &key, const char *response, int length) {
+	// a truncated response lacks records, the client has to retry over TCP anyway
+	dns_message_struct parsed;
+	uint32_t ttl;
+	if (!parse_message(response, length, parsed) || parsed.header.isTruncated() || !find_min_ttl(parsed, ttl) || ttl == 0) {
+		return;
+	}
+
+	auto now = std::chrono::steady_clock::now();
+	if (!make_room_in_cache(cache, RESPONSE_CACHE_MAX_ENTRIES, now)) {
+		return;
+	}
+
+	cache[key] = {std::vector<char>(response, response + length), now + std::chrono::seconds(ttl)};
+}
+
+// Milliseconds since the query was received
+long get_query_age_ms(const pending_query_struct &query) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (now.tv_sec - query.received_at.tv_sec) * 1000 + (now.tv_nsec - query.received_at.tv_nsec) / 1000000;
+}
+
+// Answers a query we won't process as cheaply as possible: only the header and question section are sent back
+void send_shed_response(int udpSocket, const char *query, int length, const struct sockaddr_in &address, shed_policy policy) {
+	if (policy == drop_query || length < (int)sizeof(header_struct)) {
+		return;
+	}
+
+	char response[512];
+	header_struct h_n;
+	memcpy(&h_n, query, sizeof(header_struct));
+	header_struct h_h = convert_struct_byte_order(h_n, ntohs);
+
+	int responseSize = skip_question_section(query, length);
+	if (responseSize == -1) {
+		responseSize = sizeof(header_struct);
+		h_h.qdcount = 0;
+	}
+	memcpy(response, query, responseSize);
+
+	h_h.setQuery(true);
+	h_h.setRecursionAvailable(true);
+	// https://www.rfc-editor.org/rfc/rfc1035#section-4.1.1
+	h_h.setRcode(policy == answer_servfail ? 2 : 5);
+	h_h.ancount = 0;
+	h_h.nscount = 0;
+	h_h.arcount = 0;
+	h_n = convert_struct_byte_order(h_h, htons);
+	memcpy(response, &h_n, sizeof(header_struct));
+
+	if (sendto(udpSocket, response, responseSize, 0, reinterpret_cast<const struct sockaddr *>(&address), sizeof(address)) == -1) {
+		perror("Failed to send response to shed query");
+	}
+}
+
+void shed_query(int udpSocket, const pending_query_struct &query, shed_policy policy, const char *reason) {
+	printf("Shedding query (%s), it is %ld ms old\n", reason, get_query_age_ms(query));
+
+	send_shed_response(udpSocket, query.data, query.length, query.address, policy);
+}
+
+// Receives one datagram together with the time the kernel received it
+int receive_query(int udpSocket, pending_query_struct &query, int flags) {
+	struct iovec iov = {query.data, sizeof(query.data)};
+	char control[CMSG_SPACE(sizeof(struct timespec))];
+
+	struct msghdr msg = {};
+	msg.msg_name = &query.address;
+	msg.msg_namelen = sizeof(query.address);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	query.length = recvmsg(udpSocket, &msg, flags);
+	if (query.length == -1) {
+		return -1;
+	}
+
+	bool timestamp_found = false;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			memcpy(&query.received_at, CMSG_DATA(cmsg), sizeof(query.received_at));
+			timestamp_found = true;
+		}
+	}
+	if (!timestamp_found) {
+		clock_gettime(CLOCK_REALTIME, &query.received_at);
+	}
+
+	return query.length;
+}
+
 int setup_socket(int &udpSocket) {
 	udpSocket = socket(AF_INET, SOCK_DGRAM, 0);
 	if (udpSocket == -1) {
@@ -513,60 +634,96 @@ int set_up_connection_as_server(const udp_connection_type &udp_connection_type,
 	return 0;
 }
 
-int main(int argc, char *argv[]) {
-	for (int i = 0; i < argc; i++) {
-		std::cout << "argv: " << argv[i] << std::endl;
+int configure_server_socket_for_overload(int udpSocket, const overload_config_struct &overload_config) {
+	// the kernel stamps each datagram on arrival, so time spent in the socket buffer counts towards the deadline
+	if (int enable = 1; setsockopt(udpSocket, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) < 0) {
+		std::cerr << "SO_TIMESTAMPNS failed: " << strerror(errno) << std::endl;
+		return 1;
+	}
+
+	if (overload_config.socket_buffer_bytes > 0) {
+		if (setsockopt(udpSocket, SOL_SOCKET, SO_RCVBUF, &overload_config.socket_buffer_bytes, sizeof(overload_config.socket_buffer_bytes)) < 0) {
+			std::cerr << "SO_RCVBUF failed: " << strerror(errno) << std::endl;
+			return 1;
+		}
 	}
 
-	bool query_resolving_server;
+	int socket_buffer_bytes;
+	socklen_t option_length = sizeof(socket_buffer_bytes);
+	getsockopt(udpSocket, SOL_SOCKET, SO_RCVBUF, &socket_buffer_bytes, &option_length);
+	printf("Socket receive buffer: %d bytes, queue depth: %zu, deadline: %d ms\n", socket_buffer_bytes, overload_config.queue_depth, overload_config.deadline_ms);
 
-	std::string resolver_address;
-	if (argc == 3 && strcmp("--resolver", argv[1]) == 0) {
-		resolver_address = argv[2];
-		query_resolving_server = true;
-	} else {
-		// Cloudflare DNS server
-		resolver_address = "1.1.1.1";
+	return 0;
+}
 
-		// disable it for now if no --resolver argument is used so the tests pass
-		// the tests expect longassdomainname.com to be resolved to 8.8.8.8
-		query_resolving_server = false;
+// Only a response from the resolving server that carries the ID and the questions of the query answers it
+bool is_response_to_query(const char *response, int length, const struct sockaddr_in &sender, const pending_query_struct &query, const struct sockaddr_in &resolverAddress) {
+	if (sender.sin_addr.s_addr != resolverAddress.sin_addr.s_addr || sender.sin_port != resolverAddress.sin_port) {
+		return false;
 	}
 
-	printf("Using server at %s as DNS resolver\n", resolver_address.c_str());
+	if (length < (int)sizeof(header_struct) || memcmp(response, query.data, sizeof(uint16_t)) != 0) {
+		return false;
+	}
 
-	// Flush after every std::cout / std::cerr
-	std::cout << std::unitbuf;
-	std::cerr << std::unitbuf;
+	// a query we can't parse can't be cached either, so the ID has to do
+	dns_message_struct parsed_query;
+	if (!parse_message(query.data, query.length, parsed_query)) {
+		return true;
+	}
 
-	// Disable output buffering
-	setbuf(stdout, nullptr);
+	dns_message_struct parsed_response;
+	if (!parse_message(response, length, parsed_response) || !parsed_response.header.isQuery() || parsed_response.questions.size() != parsed_query.questions.size()) {
+		return false;
+	}
+	for (size_t i = 0; i < parsed_query.questions.size(); i++) {
+		const dns_question_struct &asked = parsed_query.questions[i];
+		const dns_question_struct &answered = parsed_response.questions[i];
+		if (asked.name != answered.name || asked.type != answered.type || asked._class != answered._class) {
+			return false;
+		}
+	}
 
-	// You can use print statements as follows for debugging, they'll be visible when running tests.
-	std::cout << "Logs from your program will appear here!" << std::endl;
+	return true;
+}
 
-	// https://www.geeksforgeeks.org/udp-client-server-using-connect-c-implementation/
-	// [ e.g. dig ] -> [my DNS server] | [my DNS client] -> [resolving server]
-	// [UDP client] -> [  UDP server ] | [  UDP client ] -> [   UDP server   ]
+// Waits for the response to the forwarded request, skipping late responses to earlier requests.
+// Gives up once the query's deadline has passed.
+int receive_from_resolving_server(int resolverUdpSocket, const struct sockaddr_in &resolverAddress, char *response, int responseBufferSize, const pending_query_struct &query, int deadline_ms) {
+	while (true) {
+		// only wait for what's left of the deadline, a timeout of 0 would block forever
+		long remaining_ms = deadline_ms - get_query_age_ms(query);
+		if (remaining_ms <= 0) {
+			errno = EAGAIN;
+			return -1;
+		}
 
-	int clientUdpSocket;
-	struct sockaddr_in clientAddress;
-	socklen_t clientAddrLen = sizeof(clientAddress);
-	if (set_up_connection_as_server(udp_connection_type::server, clientUdpSocket, clientAddress, 2053)) {
-		return 1;
-	}
+		struct timeval timeout = {remaining_ms / 1000, (remaining_ms % 1000) * 1000};
+		if (setsockopt(resolverUdpSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+			return -1;
+		}
 
-	// One cannot call bind() again on a socket that is already bound. Once a socket is bound, its binding cannot be changed.
-	// https://stackoverflow.com/a/43332930/2278742
-	int resolverUdpSocket;
-	struct sockaddr_in resolverAddress;
-	socklen_t resolverAddrLen = sizeof(resolverAddress);
-	if (set_up_connection_as_client(udp_connection_type::client, resolverUdpSocket, resolverAddress, 2054, resolver_address)) {
-		return 1;
+		struct sockaddr_in sender;
+		socklen_t senderLength = sizeof(sender);
+		int bytesRead = recvfrom(resolverUdpSocket, response, responseBufferSize, 0, reinterpret_cast<struct sockaddr *>(&sender), &senderLength);
+		if (bytesRead == -1) {
+			return -1;
+		}
+
+		// anything else would end up in the cache and be handed out to every client asking the same question
+		if (is_response_to_query(response, bytesRead, sender, query, resolverAddress)) {
+			return bytesRead;
+		}
+
+		printf("Discarding stale response from resolving DNS server\n");
 	}
+}
+
+void handle_query(const pending_query_struct &query, int clientUdpSocket, int resolverUdpSocket, const struct sockaddr_in &resolverAddress, bool query_resolving_server, response_cache &cache, const overload_config_struct &overload_config) {
+	int bytesRead = query.length;
+	const struct sockaddr_in &clientAddress = query.address;
 
-	int bytesRead;
-	char requestFromClient[512];
+	char requestFromClient[512] = {};
 	char responseToClient[512];
 
 	char responseFromResolvingDNS[512];
@@ -578,112 +735,402 @@ int main(int argc, char *argv[]) {
 	bool question_section_enabled = true || answer_section_enabled;
 	bool add_header_section = true || question_section_enabled;
 
-	while (true) {
-		int responseSize = sizeof(header_struct);
+	int responseSize = sizeof(header_struct);
 
-		std::printf("↓↓↓↓↓↓↓↓↓↓↓↓↓↓↓↓↓↓↓↓\n");
+	memcpy(requestFromClient, query.data, bytesRead);
+	std::cout << "Received UDP packet with " << bytesRead << " bytes" << std::endl;
 
-		// Receive data
-		bytesRead = recvfrom(clientUdpSocket, requestFromClient, sizeof(requestFromClient), 0, reinterpret_cast<struct sockaddr *>(&clientAddress), &clientAddrLen);
-		if (bytesRead == -1) {
-			perror("Error receiving data");
-			break;
-		}
+	print_message("request", requestFromClient, bytesRead);
 
-		requestFromClient[bytesRead] = '\0';
-		std::cout << "Received UDP packet with " << bytesRead << " bytes" << std::endl;
+	int bytesReadFromResolvingDNS;
 
-		print_message("request", requestFromClient, bytesRead);
+	if (query_resolving_server) {
+		std::string cache_key;
+		bool cacheable = get_response_cache_key(requestFromClient, bytesRead, cache_key);
 
-		int bytesReadFromResolvingDNS;
+		bytesReadFromResolvingDNS = -1;
+		if (cacheable && lookup_response_cache(cache, cache_key)) {
+			bytesReadFromResolvingDNS = build_cached_response(requestFromClient, bytesRead, cache[cache_key].response, responseFromResolvingDNS, sizeof(responseFromResolvingDNS));
+		}
+
+		if (bytesReadFromResolvingDNS != -1) {
+			printf("Answering from cache\n");
 
-		if (query_resolving_server) {
+			limit_ttls(responseFromResolvingDNS, bytesReadFromResolvingDNS, get_remaining_ttl(cache[cache_key].expires_at, std::chrono::steady_clock::now()));
+		} else {
 			printf("Forwarding received UDP packet to resolving DNS server\n");
 
-			if (sendto(resolverUdpSocket, &requestFromClient, sizeof(requestFromClient), 0, reinterpret_cast<struct sockaddr *>(&resolverAddress), sizeof(resolverAddress)) == -1) {
+			if (sendto(resolverUdpSocket, &requestFromClient, sizeof(requestFromClient), 0, reinterpret_cast<const struct sockaddr *>(&resolverAddress), sizeof(resolverAddress)) == -1) {
 				perror("Failed to forward UDP packet to resolver DNS server");
 			}
 
-			bytesReadFromResolvingDNS = recvfrom(resolverUdpSocket, responseFromResolvingDNS, sizeof(responseFromResolvingDNS), 0, reinterpret_cast<struct sockaddr *>(&resolverAddress), &resolverAddrLen);
-			std::cout << "Received UDP packet with " << bytesRead << " bytes from resolving DNS server" << std::endl;
+			bytesReadFromResolvingDNS = receive_from_resolving_server(resolverUdpSocket, resolverAddress, responseFromResolvingDNS, sizeof(responseFromResolvingDNS), query, overload_config.deadline_ms);
+			if (bytesReadFromResolvingDNS == -1) {
+				perror("No response from resolving DNS server");
+				shed_query(clientUdpSocket, query, overload_config.policy, "deadline exceeded while waiting for the resolving server");
+				return;
+			}
 
-			print_message("response from resolving DNS server", responseFromResolvingDNS, bytesReadFromResolvingDNS);
+			std::cout << "Received UDP packet with " << bytesReadFromResolvingDNS << " bytes from resolving DNS server" << std::endl;
 
-			// Send response
-			if (sendto(clientUdpSocket, &responseFromResolvingDNS, bytesReadFromResolvingDNS, 0, reinterpret_cast<struct sockaddr *>(&clientAddress), sizeof(clientAddress)) == -1) {
-				perror("Failed to send response");
+			if (cacheable) {
+				store_in_response_cache(cache, cache_key, responseFromResolvingDNS, bytesReadFromResolvingDNS);
 			}
 		}
 
-		// Copy request to create response
-		memcpy(responseToClient, requestFromClient, bytesRead);
+		print_message("response from resolving DNS server", responseFromResolvingDNS, bytesReadFromResolvingDNS);
+
+		// Send response
+		if (sendto(clientUdpSocket, &responseFromResolvingDNS, bytesReadFromResolvingDNS, 0, reinterpret_cast<const struct sockaddr *>(&clientAddress), sizeof(clientAddress)) == -1) {
+			perror("Failed to send response");
+		}
+	}
 
-		int questionLength = 0;
-		int answerLength = 0;
+	// Copy request to create response
+	memcpy(responseToClient, requestFromClient, bytesRead);
 
-		if (add_header_section) {
-			memcpy(&h_n, requestFromClient, sizeof(header_struct));
+	int questionLength = 0;
+	int answerLength = 0;
 
-			h_h = convert_struct_byte_order(h_n, ntohs);
+	if (add_header_section) {
+		memcpy(&h_n, requestFromClient, sizeof(header_struct));
 
-			print_header_struct(h_h);
-			h_h.setQuery(true);
-			h_h.setReserved(0);
-			if (h_h.getOpcode() == 0) {
-				h_h.setRcode(0);
-			} else {
-				h_h.setRcode(4);
-			}
+		h_h = convert_struct_byte_order(h_n, ntohs);
+
+		print_header_struct(h_h);
+		h_h.setQuery(true);
+		h_h.setReserved(0);
+		if (h_h.getOpcode() == 0) {
+			h_h.setRcode(0);
+		} else {
+			h_h.setRcode(4);
+		}
 
 #ifdef DEBUG
-			h_h.qdcount = 44;
-			h_h.ancount = 55;
-			h_h.nscount = 66;
-			h_h.arcount = 77;
+		h_h.qdcount = 44;
+		h_h.ancount = 55;
+		h_h.nscount = 66;
+		h_h.arcount = 77;
 #endif
 
-			h_n = convert_struct_byte_order(h_h, htons);
-			memcpy(responseToClient, &h_n, sizeof(header_struct));
+		h_n = convert_struct_byte_order(h_h, htons);
+		memcpy(responseToClient, &h_n, sizeof(header_struct));
+
+		print_message("response after adding header section", responseToClient, responseSize);
+	}
+
+	char questions[512];
+	memcpy(&questions, requestFromClient + 12, sizeof(requestFromClient) - 12);
+
+	print_hex("questions", questions, sizeof(requestFromClient) - 12);
+
+	printf("request contains the following questions:\n");
+	int header_size_increase = 0;
+	std::vector<std::vector<char>> questions_list = extract_questions(questions, sizeof(requestFromClient) - 12, header_size_increase);
+	responseSize += header_size_increase;
+
+	h_h.setRecursionAvailable(true);
+
+	if (question_section_enabled) {
+		h_h.qdcount = 0;
+		for (std::vector<char> question_char_vec : questions_list) {
+			std::string question(question_char_vec.begin(), question_char_vec.end());
+			print_hex("adding question", (void *)question.c_str(), question.length());
+			add_question_section(question.c_str(), h_h, responseToClient, responseSize, questionLength, h_n);
+		}
+
+		print_message("response after adding question section", responseToClient, responseSize);
+	}
+
+	if (answer_section_enabled) {
+		for (std::vector<char> question_char_vec : questions_list) {
+			std::string question(question_char_vec.begin(), question_char_vec.end());
+			print_hex("adding answer to question", (void *)question.c_str(), question.length());
+			add_answer_section(question, h_h, responseToClient, responseSize, questionLength, answerLength, h_n);
+		}
+
+		print_message("response after adding answer section", responseToClient, responseSize);
+	}
+
+	// Send response
+	if (sendto(clientUdpSocket, &responseToClient, responseSize, 0, reinterpret_cast<const struct sockaddr *>(&clientAddress), sizeof(clientAddress)) == -1) {
+		perror("Failed to send response");
+	}
+}
+
+void handle_recursive_query(const pending_query_struct &query, int clientUdpSocket, recursive_resolver_struct &resolver, const overload_config_struct &overload_config) {
+	std::vector<char> response;
+	if (resolver.answerFromCache(query.data, query.length, response)) {
+		printf("Answering from cache\n");
+		if (sendto(clientUdpSocket, response.data(), response.size(), 0, reinterpret_cast<const struct sockaddr *>(&query.address), sizeof(query.address)) == -1) {
+			perror("Failed to send response");
+		}
+		return;
+	}
+
+	// the resolution gets whatever is left of the deadline
+	resolution_request_struct request;
+	request.query.assign(query.data, query.data + query.length);
+	request.client_address = query.address;
+	request.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(overload_config.deadline_ms - get_query_age_ms(query));
+
+	if (!resolver.submit(std::move(request))) {
+		shed_query(clientUdpSocket, query, overload_config.policy, "too many resolutions in flight");
+	}
+}
+
+// Cache hits and locally answered queries are cheap and go first; queries that wait for the resolving server go last
+bool is_upstream_bound(const pending_query_struct &query, bool query_resolving_server, response_cache &cache, recursive_resolver_struct *resolver) {
+	if (resolver != nullptr) {
+		return !resolver->hasCachedAnswer(query.data, query.length);
+	}
+
+	if (!query_resolving_server) {
+		return false;
+	}
 
-			print_message("response after adding header section", responseToClient, responseSize);
+	std::string cache_key;
+	return !get_response_cache_key(query.data, query.length, cache_key) || !lookup_response_cache(cache, cache_key);
+}
+
+// Parses the value of a numeric argument, bad input is reported instead of aborting the program
+bool parse_numeric_argument(const char *option, const char *value, long minimum, long maximum, long &result) {
+	try {
+		size_t parsed_length;
+		result = std::stol(value, &parsed_length);
+		if (parsed_length == strlen(value) && result >= minimum && result <= maximum) {
+			return true;
 		}
+	} catch (const std::exception &) {
+		// std::invalid_argument or std::out_of_range, reported below
+	}
 
-		char questions[512];
-		memcpy(&questions, requestFromClient + 12, sizeof(requestFromClient) - 12);
+	std::cerr << "Invalid value " << value << " for " << option << ", expected a number from " << minimum << " to " << maximum << std::endl;
+	return false;
+}
 
-		print_hex("questions", questions, sizeof(requestFromClient) - 12);
+int main(int argc, char *argv[]) {
+	for (int i = 0; i < argc; i++) {
+		std::cout << "argv: " << argv[i] << std::endl;
+	}
 
-		printf("request contains the following questions:\n");
-		int header_size_increase = 0;
-		std::vector<std::vector<char>> questions_list = extract_questions(questions, sizeof(requestFromClient) - 12, header_size_increase);
-		responseSize += header_size_increase;
+	bool query_resolving_server = false;
 
-		h_h.setRecursionAvailable(true);
+	// Cloudflare DNS server
+	std::string resolver_address = "1.1.1.1";
 
-		if (question_section_enabled) {
-			h_h.qdcount = 0;
-			for (std::vector<char> question_char_vec : questions_list) {
-				std::string question(question_char_vec.begin(), question_char_vec.end());
-				print_hex("adding question", (void *)question.c_str(), question.length());
-				add_question_section(question.c_str(), h_h, responseToClient, responseSize, questionLength, h_n);
+	overload_config_struct overload_config;
+
+	// iterative resolution starting at the root servers instead of forwarding to --resolver
+	bool resolve_recursively = false;
+	resolver_config_struct resolver_config;
+	std::string root_hints;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp("--recursive", argv[i]) == 0) {
+			resolve_recursively = true;
+			continue;
+		}
+
+		if (i + 1 >= argc) {
+			std::cerr << "Missing value for " << argv[i] << std::endl;
+			return 1;
+		}
+
+		long value;
+
+		if (strcmp("--resolver", argv[i]) == 0) {
+			resolver_address = argv[++i];
+			query_resolving_server = true;
+		} else if (strcmp("--deadline-ms", argv[i]) == 0) {
+			// a deadline of 0 would shed every query, and turn the resolver socket's timeout into blocking forever
+			if (!parse_numeric_argument(argv[i], argv[i + 1], 1, INT_MAX, value)) {
+				return 1;
+			}
+			overload_config.deadline_ms = value;
+			i++;
+		} else if (strcmp("--queue-depth", argv[i]) == 0) {
+			// queries are only received while there's room to queue them
+			if (!parse_numeric_argument(argv[i], argv[i + 1], 1, INT_MAX, value)) {
+				return 1;
 			}
+			overload_config.queue_depth = value;
+			i++;
+		} else if (strcmp("--socket-buffer-bytes", argv[i]) == 0) {
+			if (!parse_numeric_argument(argv[i], argv[i + 1], 0, INT_MAX, value)) {
+				return 1;
+			}
+			overload_config.socket_buffer_bytes = value;
+			i++;
+		} else if (strcmp("--shed-policy", argv[i]) == 0) {
+			std::string policy = argv[++i];
+			if (policy == "drop") {
+				overload_config.policy = drop_query;
+			} else if (policy == "servfail") {
+				overload_config.policy = answer_servfail;
+			} else if (policy == "refused") {
+				overload_config.policy = answer_refused;
+			} else {
+				std::cerr << "Unknown shed policy " << policy << ", expected drop, servfail or refused" << std::endl;
+				return 1;
+			}
+		} else if (strcmp("--root-hints", argv[i]) == 0) {
+			root_hints = argv[++i];
+		} else if (strcmp("--upstream-port", argv[i]) == 0) {
+			if (!parse_numeric_argument(argv[i], argv[i + 1], 1, 65535, value)) {
+				return 1;
+			}
+			resolver_config.upstream_port = value;
+			i++;
+		} else if (strcmp("--resolver-threads", argv[i]) == 0) {
+			if (!parse_numeric_argument(argv[i], argv[i + 1], 1, 1024, value)) {
+				return 1;
+			}
+			resolver_config.threads = value;
+			i++;
+		} else if (strcmp("--max-in-flight", argv[i]) == 0) {
+			if (!parse_numeric_argument(argv[i], argv[i + 1], 1, INT_MAX, value)) {
+				return 1;
+			}
+			resolver_config.max_in_flight = value;
+			i++;
+		} else {
+			std::cerr << "Unknown argument " << argv[i] << std::endl;
+			return 1;
+		}
+	}
 
-			print_message("response after adding question section", responseToClient, responseSize);
+	if (resolve_recursively && query_resolving_server) {
+		std::cerr << "--recursive and --resolver can't be used together" << std::endl;
+		return 1;
+	}
+
+	// comma separated list of ip[:port], the port defaults to --upstream-port
+	if (root_hints.empty()) {
+		resolver_config.root_hints = get_default_root_hints(resolver_config.upstream_port);
+	} else {
+		std::stringstream ss(root_hints);
+		std::string root_hint;
+		while (std::getline(ss, root_hint, ',')) {
+			struct sockaddr_in server;
+			if (!parse_server_address(root_hint, resolver_config.upstream_port, server)) {
+				std::cerr << "Invalid root hint " << root_hint << std::endl;
+				return 1;
+			}
+			resolver_config.root_hints.push_back(server);
 		}
+	}
+
+	// if no --resolver argument is used, the resolving server stays disabled so the tests pass
+	// the tests expect longassdomainname.com to be resolved to 8.8.8.8
+	printf("Using server at %s as DNS resolver\n", resolver_address.c_str());
+
+	// Flush after every std::cout / std::cerr
+	std::cout << std::unitbuf;
+	std::cerr << std::unitbuf;
+
+	// Disable output buffering
+	setbuf(stdout, nullptr);
 
-		if (answer_section_enabled) {
-			for (std::vector<char> question_char_vec : questions_list) {
-				std::string question(question_char_vec.begin(), question_char_vec.end());
-				print_hex("adding answer to question", (void *)question.c_str(), question.length());
-				add_answer_section(question, h_h, responseToClient, responseSize, questionLength, answerLength, h_n);
+	// You can use print statements as follows for debugging, they'll be visible when running tests.
+	std::cout << "Logs from your program will appear here!" << std::endl;
+
+	// https://www.geeksforgeeks.org/udp-client-server-using-connect-c-implementation/
+	// [ e.g. dig ] -> [my DNS server] | [my DNS client] -> [resolving server]
+	// [UDP client] -> [  UDP server ] | [  UDP client ] -> [   UDP server   ]
+
+	int clientUdpSocket;
+	struct sockaddr_in clientAddress;
+	if (set_up_connection_as_server(udp_connection_type::server, clientUdpSocket, clientAddress, 2053)) {
+		return 1;
+	}
+	if (configure_server_socket_for_overload(clientUdpSocket, overload_config)) {
+		return 1;
+	}
+
+	// One cannot call bind() again on a socket that is already bound. Once a socket is bound, its binding cannot be changed.
+	// https://stackoverflow.com/a/43332930/2278742
+	int resolverUdpSocket;
+	struct sockaddr_in resolverAddress;
+	if (set_up_connection_as_client(udp_connection_type::client, resolverUdpSocket, resolverAddress, 2054, resolver_address)) {
+		return 1;
+	}
+
+	response_cache cache;
+
+	std::unique_ptr<recursive_resolver_struct> resolver;
+	if (resolve_recursively) {
+		shed_policy policy = overload_config.policy;
+		resolver = std::make_unique<recursive_resolver_struct>(resolver_config, [clientUdpSocket, policy](const resolution_request_struct &request, const std::vector<char> &response) {
+			if (response.empty()) {
+				printf("Shedding query (deadline exceeded during resolution)\n");
+				send_shed_response(clientUdpSocket, request.query.data(), request.query.size(), request.client_address, policy);
+				return;
 			}
 
-			print_message("response after adding answer section", responseToClient, responseSize);
+			if (sendto(clientUdpSocket, response.data(), response.size(), 0, reinterpret_cast<const struct sockaddr *>(&request.client_address), sizeof(request.client_address)) == -1) {
+				perror("Failed to send response");
+			}
+		});
+		if (resolver->start()) {
+			return 1;
 		}
+	}
 
-		// Send response
-		if (sendto(clientUdpSocket, &responseToClient, responseSize, 0, reinterpret_cast<struct sockaddr *>(&clientAddress), sizeof(clientAddress)) == -1) {
-			perror("Failed to send response");
+	// Queries are moved out of the kernel socket buffer into these bounded queues as soon as possible,
+	// so that their age is known and the cheap ones can overtake the ones waiting for the resolving server
+	std::deque<pending_query_struct> local_queue;
+	std::deque<pending_query_struct> upstream_queue;
+
+	while (true) {
+		// block only if there's nothing left to do
+		int receive_flags = (local_queue.empty() && upstream_queue.empty()) ? 0 : MSG_DONTWAIT;
+		bool receive_failed = false;
+
+		// receiving is bounded as well, otherwise a flood would keep us from answering anything
+		for (size_t received = 0; received < 2 * overload_config.queue_depth; received++) {
+			pending_query_struct query = {};
+			if (receive_query(clientUdpSocket, query, receive_flags) == -1) {
+				if (errno != EAGAIN && errno != EWOULDBLOCK) {
+					perror("Error receiving data");
+					receive_failed = true;
+				}
+				break;
+			}
+			receive_flags = MSG_DONTWAIT;
+
+			std::deque<pending_query_struct> &queue = is_upstream_bound(query, query_resolving_server, cache, resolver.get()) ? upstream_queue : local_queue;
+			if (queue.size() >= overload_config.queue_depth) {
+				shed_query(clientUdpSocket, query, overload_config.policy, "queue full");
+			} else {
+				queue.push_back(query);
+			}
+		}
+
+		if (receive_failed) {
+			break;
+		}
+
+		if (local_queue.empty() && upstream_queue.empty()) {
+			continue;
+		}
+
+		std::deque<pending_query_struct> &queue = local_queue.empty() ? upstream_queue : local_queue;
+		pending_query_struct query = queue.front();
+		queue.pop_front();
+
+		// the client has most likely retried already, answering now would be wasted work
+		if (get_query_age_ms(query) > overload_config.deadline_ms) {
+			shed_query(clientUdpSocket, query, overload_config.policy, "deadline exceeded");
+			continue;
+		}
+
+		std::printf("↓↓↓↓↓↓↓↓↓↓↓↓↓↓↓↓↓↓↓↓\n");
+
+		if (resolver) {
+			handle_recursive_query(query, clientUdpSocket, *resolver, overload_config);
+		} else {
+			handle_query(query, clientUdpSocket, resolverUdpSocket, resolverAddress, query_resolving_server, cache, overload_config);
 		}
 
 		std::printf("↑↑↑↑↑↑↑↑↑↑↑↑↑↑↑↑↑↑↑↑\n");
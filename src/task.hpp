@@ -0,0 +1,103 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+// Lazily started coroutine that produces a T for whoever co_awaits it.
+// The awaiting coroutine is resumed directly when the task finishes (symmetric transfer),
+// so deep chains of co_await don't grow the stack.
+// https://en.cppreference.com/w/cpp/language/coroutines
+template <typename T>
+class task {
+  public:
+	struct promise_type {
+		std::optional<T> value;
+		std::coroutine_handle<> continuation;
+
+		task get_return_object() {
+			return task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		std::suspend_always initial_suspend() noexcept {
+			return {};
+		}
+
+		struct final_awaiter {
+			bool await_ready() noexcept {
+				return false;
+			}
+
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+				return handle.promise().continuation;
+			}
+
+			void await_resume() noexcept {}
+		};
+
+		final_awaiter final_suspend() noexcept {
+			return {};
+		}
+
+		void return_value(T result) {
+			value = std::move(result);
+		}
+
+		void unhandled_exception() {
+			std::terminate();
+		}
+	};
+
+	explicit task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+	task(task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+
+	~task() {
+		if (handle) {
+			handle.destroy();
+		}
+	}
+
+	bool await_ready() const noexcept {
+		return false;
+	}
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+		handle.promise().continuation = awaiting;
+		return handle;
+	}
+
+	T await_resume() {
+		return std::move(*handle.promise().value);
+	}
+
+  private:
+	std::coroutine_handle<promise_type> handle;
+};
+
+// Coroutine that starts immediately and cleans up after itself, used for the outermost coroutine of a resolution
+struct detached_task {
+	struct promise_type {
+		detached_task get_return_object() {
+			return {};
+		}
+
+		std::suspend_never initial_suspend() noexcept {
+			return {};
+		}
+
+		std::suspend_never final_suspend() noexcept {
+			return {};
+		}
+
+		void return_void() {}
+
+		void unhandled_exception() {
+			std::terminate();
+		}
+	};
+};